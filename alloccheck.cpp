@@ -0,0 +1,180 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+/*
+ * Built by `make alloc-check'. Replays probes and reports of a set of
+ * sources through handle_nmsg() and fails if, once every source and entry
+ * is known, handling them allocates memory. malloc() and operator new are
+ * interposed to count the allocations, which needs glibc.
+ */
+
+#include "dbeacon.h"
+#include "protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <new>
+
+extern "C" {
+	void *__libc_malloc(size_t);
+	void *__libc_calloc(size_t, size_t);
+	void *__libc_realloc(void *, size_t);
+	void __libc_free(void *);
+}
+
+static bool counting = false;
+static unsigned long allocations = 0;
+
+extern "C" void *malloc(size_t n) {
+	if (counting)
+		allocations++;
+	return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+	if (counting)
+		allocations++;
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t n) {
+	if (counting)
+		allocations++;
+	return __libc_realloc(p, n);
+}
+
+extern "C" void free(void *p) {
+	__libc_free(p);
+}
+
+void *operator new(size_t n) {
+	void *p = malloc(n ? n : 1);
+	if (p == 0)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t n) {
+	return operator new(n);
+}
+
+void operator delete(void *p) throw() {
+	free(p);
+}
+
+void operator delete[](void *p) throw() {
+	free(p);
+}
+
+#define SOURCES		40
+#define WARMUP		20
+#define ROUNDS		200
+
+static address addrs[SOURCES];
+static uint8_t reports[SOURCES][8192];
+static int reportLen[SOURCES];
+
+static void put_string(uint8_t *buff, int &ptr, uint8_t type, const char *str) {
+	buff[ptr++] = type;
+	buff[ptr++] = strlen(str);
+	memcpy(buff + ptr, str, strlen(str));
+	ptr += strlen(str);
+}
+
+static void put_tlv(uint8_t *buff, int &ptr, uint8_t type, int len) {
+	buff[ptr++] = type;
+	buff[ptr++] = len;
+	memset(buff + ptr, 1, len);
+	ptr += len;
+}
+
+/* the stats report of source `k', about all of the others */
+static int build(uint8_t *buff, int k) {
+	char name[32];
+	int ptr = 0;
+
+	buff[ptr++] = 0xbe;
+	buff[ptr++] = 0xac;
+	buff[ptr++] = PROTO_VER;
+	buff[ptr++] = 1;
+	buff[ptr++] = 64;
+
+	snprintf(name, sizeof(name), "beacon-%i", k);
+	put_string(buff, ptr, T_BEAC_NAME, name);
+	put_string(buff, ptr, T_ADMIN_CONTACT, "admin@example.net");
+	put_string(buff, ptr, T_CC, "PT");
+
+	for (int j = 0; j < SOURCES; j++) {
+		buff[ptr++] = T_SOURCE_INFO_IPv4;
+		buff[ptr++] = 6 + 2 * (22 + 2 + PCOUNT * 8);
+		memcpy(buff + ptr, &addrs[j].v4()->sin_addr, sizeof(in_addr));
+		memcpy(buff + ptr + 4, &addrs[j].v4()->sin_port, sizeof(uint16_t));
+		ptr += 6;
+
+		put_tlv(buff, ptr, T_ASM_STATS, 20);
+		put_tlv(buff, ptr, T_ASM_PERCENTILES, PCOUNT * 8);
+		put_tlv(buff, ptr, T_SSM_STATS, 20);
+		put_tlv(buff, ptr, T_SSM_PERCENTILES, PCOUNT * 8);
+	}
+
+	return ptr;
+}
+
+static void replay(beaconSession &session, uint32_t round) {
+	static uint8_t buff[8192];
+	uint8_t probe[12] = { 0xbe, 0xac, PROTO_VER, 0 };
+
+	uint32_t seq = htonl(round), ts = htonl(round * 100);
+	memcpy(probe + 4, &seq, 4);
+	memcpy(probe + 8, &ts, 4);
+
+	for (int k = 0; k < SOURCES; k++) {
+		uint64_t now = get_timestamp();
+
+		handle_nmsg(session, addrs[k], now, 64, probe, sizeof(probe), false);
+		handle_nmsg(session, addrs[k], now, 64, probe, sizeof(probe), true);
+
+		/* parsing may change the buffer */
+		memcpy(buff, reports[k], reportLen[k]);
+		handle_nmsg(session, addrs[k], now, 64, buff, reportLen[k], false);
+	}
+}
+
+int main() {
+	beaconName = "alloc-check";
+	adminContact = "admin@example.net";
+
+	beaconSession *session = new beaconSession(0);
+	session->name = "239.0.0.1/10000";
+	sessions.push_back(session);
+
+	for (int k = 0; k < SOURCES; k++) {
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "10.0.%i.1/%i", k, 1000 + k);
+		if (!addrs[k].parse(tmp, false, true))
+			return 2;
+	}
+
+	for (int k = 0; k < SOURCES; k++)
+		reportLen[k] = build(reports[k], k);
+
+	uint32_t round = 1;
+
+	for (int i = 0; i < WARMUP; i++)
+		replay(*session, round++);
+
+	counting = true;
+	for (int i = 0; i < ROUNDS; i++)
+		replay(*session, round++);
+	counting = false;
+
+	printf("%lu allocations handling %u probes and %u reports of %u known sources\n",
+	       allocations, ROUNDS * SOURCES * 2, ROUNDS * SOURCES, SOURCES);
+
+	return allocations ? 1 : 0;
+}
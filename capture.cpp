@@ -0,0 +1,275 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#include "dbeacon.h"
+#include "msocket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+
+bool ParsePacket(uint8_t *net, uint32_t caplen, Message &msg, bool &ssm) {
+	uint8_t *udp;
+
+	if (caplen < 20)
+		return false;
+
+	if ((net[0] >> 4) == 4) {
+		uint32_t ihl = (net[0] & 0xf) * 4;
+		if (caplen < ihl + 8)
+			return false;
+
+		udp = net + ihl;
+
+		msg.from.set_family(AF_INET);
+		memcpy(&msg.from.v4()->sin_addr, net + 12, 4);
+		memcpy(&msg.from.v4()->sin_port, udp, 2);
+
+		msg.to.set_family(AF_INET);
+		memcpy(&msg.to.v4()->sin_addr, net + 16, 4);
+		memcpy(&msg.to.v4()->sin_port, udp + 2, 2);
+
+		msg.ttl = net[8];
+		ssm = net[16] == 232;
+	} else if ((net[0] >> 4) == 6) {
+		if (caplen < 40 + 8)
+			return false;
+
+		udp = net + 40;
+
+		msg.from.set_family(AF_INET6);
+		memcpy(&msg.from.v6()->sin6_addr, net + 8, 16);
+		memcpy(&msg.from.v6()->sin6_port, udp, 2);
+
+		msg.to.set_family(AF_INET6);
+		memcpy(&msg.to.v6()->sin6_addr, net + 24, 16);
+		memcpy(&msg.to.v6()->sin6_port, udp + 2, 2);
+
+		msg.ttl = net[7];
+		ssm = net[24] == 0xff && (net[25] & 0xf0) == 0x30;
+	} else {
+		return false;
+	}
+
+	uint32_t udplen = (udp[4] << 8) | udp[5];
+	uint32_t avail = caplen - (udp - net);
+
+	if (udplen < 8 || udplen > avail)
+		return false;
+
+	msg.buffer = udp + 8;
+	msg.len = udplen - 8;
+
+	return true;
+}
+
+#ifdef __linux__
+#include <linux/if_packet.h>
+
+#ifdef TPACKET3_HDRLEN
+#define HAVE_TPACKET_V3
+#endif
+#endif
+
+#ifdef HAVE_TPACKET_V3
+
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+
+/* 16MB ring, blocks are handed to us when full or after CAPTURE_RETIRE ms.
+ * Packets carry their own timestamp, so the retire delay doesn't show in
+ * the measured delays. */
+#define CAPTURE_BLOCK	(256 * 1024)
+#define CAPTURE_BLOCKS	64
+#define CAPTURE_FRAME	2048
+#define CAPTURE_RETIRE	10
+
+/* UDP over IPv4 or IPv6 to a multicast group, starting with the beacon
+ * magic. Offsets are from the network header; IPv4 fragments and IPv6
+ * extension headers are not looked into. */
+static sock_filter captureFilter[] = {
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+	BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 10),
+
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 16),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 14, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 16),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xe0, 0, 11),
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xbeac, 7, 8),
+
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 7),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 5),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 24),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xff, 0, 3),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 48),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xbeac, 0, 1),
+
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static int captureSock = -1;
+static uint8_t *ring;
+static uint32_t currentBlock = 0;
+
+static uint64_t capturedPackets = 0, capturedDrops = 0;
+
+int CaptureSetup(const char *ifname) {
+	int ifindex = if_nametoindex(ifname);
+	if (ifindex == 0)
+		return -1;
+
+	/* no protocol, nothing is queued before the ring is in place */
+	int sock = socket(AF_PACKET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return -1;
+
+	int version = TPACKET_V3;
+	if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+		goto fail;
+
+#ifdef PACKET_IGNORE_OUTGOING
+	{
+		int on = 1;
+		setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+	}
+#endif
+
+	{
+		sock_fprog prog;
+		prog.len = sizeof(captureFilter) / sizeof(captureFilter[0]);
+		prog.filter = captureFilter;
+
+		if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0)
+			goto fail;
+	}
+
+	{
+		tpacket_req3 req;
+		memset(&req, 0, sizeof(req));
+		req.tp_block_size = CAPTURE_BLOCK;
+		req.tp_block_nr = CAPTURE_BLOCKS;
+		req.tp_frame_size = CAPTURE_FRAME;
+		req.tp_frame_nr = CAPTURE_BLOCK / CAPTURE_FRAME * CAPTURE_BLOCKS;
+		req.tp_retire_blk_tov = CAPTURE_RETIRE;
+
+		if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+			goto fail;
+
+		void *p = mmap(NULL, CAPTURE_BLOCK * CAPTURE_BLOCKS, PROT_READ | PROT_WRITE,
+			MAP_SHARED, sock, 0);
+		if (p == MAP_FAILED)
+			goto fail;
+
+		ring = (uint8_t *)p;
+	}
+
+	{
+		/* the groups are joined by somebody else, or the traffic is
+		 * mirrored to the interface */
+		packet_mreq mr;
+		memset(&mr, 0, sizeof(mr));
+		mr.mr_ifindex = ifindex;
+		mr.mr_type = PACKET_MR_ALLMULTI;
+
+		if (setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) != 0)
+			goto fail;
+
+		sockaddr_ll sll;
+		memset(&sll, 0, sizeof(sll));
+		sll.sll_family = AF_PACKET;
+		sll.sll_protocol = htons(ETH_P_ALL);
+		sll.sll_ifindex = ifindex;
+
+		if (bind(sock, (sockaddr *)&sll, sizeof(sll)) != 0)
+			goto fail;
+	}
+
+	captureSock = sock;
+	return sock;
+
+fail:
+	int err = errno;
+	close(sock);
+	errno = err;
+	return -1;
+}
+
+static void parse_packet(const tpacket3_hdr *hdr, void (*handler)(const Message &, bool)) {
+	Message msg;
+	bool ssm;
+
+	if (!ParsePacket((uint8_t *)hdr + hdr->tp_net, hdr->tp_snaplen, msg, ssm))
+		return;
+
+	msg.timestamp = hdr->tp_sec * (uint64_t)1000 + hdr->tp_nsec / 1000000;
+	if (!msg.timestamp)
+		msg.timestamp = get_time_of_day();
+
+	handler(msg, ssm);
+}
+
+void CaptureRead(void (*handler)(const Message &, bool ssm)) {
+	while (1) {
+		tpacket_block_desc *block = (tpacket_block_desc *)(ring + currentBlock * CAPTURE_BLOCK);
+		tpacket_hdr_v1 &bh = block->hdr.bh1;
+
+		if (!(__atomic_load_n(&bh.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			return;
+
+		const uint8_t *p = (const uint8_t *)block + bh.offset_to_first_pkt;
+
+		for (uint32_t i = 0; i < bh.num_pkts; i++) {
+			const tpacket3_hdr *hdr = (const tpacket3_hdr *)p;
+
+			parse_packet(hdr, handler);
+			p += hdr->tp_next_offset;
+		}
+
+		capturedPackets += bh.num_pkts;
+
+		__atomic_store_n(&bh.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+		currentBlock = (currentBlock + 1) % CAPTURE_BLOCKS;
+	}
+}
+
+void CaptureStats(uint64_t &packets, uint64_t &drops) {
+	tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	/* the kernel counters reset on every read */
+	if (captureSock >= 0 && getsockopt(captureSock, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+		capturedDrops += st.tp_drops;
+
+	packets = capturedPackets;
+	drops = capturedDrops;
+}
+
+#else
+
+int CaptureSetup(const char *) {
+	errno = ENOSYS;
+	return -1;
+}
+
+void CaptureRead(void (*)(const Message &, bool)) {
+}
+
+void CaptureStats(uint64_t &packets, uint64_t &drops) {
+	packets = drops = 0;
+}
+
+#endif
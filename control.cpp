@@ -0,0 +1,593 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#include "dbeacon.h"
+#include "address.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include <string>
+
+using namespace std;
+
+/*
+ * Control socket. Clients connect to a UNIX stream socket and send one
+ * command per line, every reply ends with a line reading "OK" or
+ * "ERR <reason>". Commands run from the event loop, between packets, and
+ * queries go through the source index and the pair matrices, so they cost
+ * the same however many sources there are.
+ *
+ * Replies are sent without blocking, a client that doesn't read them is
+ * dropped, as is one sending lines longer than CONTROL_LINE.
+ */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+#define CONTROL_CLIENTS	8
+#define CONTROL_LINE	512
+#define CONTROL_ARGS	8
+
+struct controlClient {
+	int sock;
+	uint32_t len;
+	char line[CONTROL_LINE];
+};
+
+static int listenSock = -1;
+static controlClient clients[CONTROL_CLIENTS];
+
+/* reply being built */
+static string reply;
+
+static void out(const char *format, ...) {
+	char buf[256];
+	va_list vl;
+
+	va_start(vl, format);
+	int len = vsnprintf(buf, sizeof(buf), format, vl);
+	va_end(vl);
+
+	if (len < (int)sizeof(buf)) {
+		reply += buf;
+		return;
+	}
+
+	/* a longer line is formatted again, right into the reply */
+	size_t pos = reply.size();
+	reply.resize(pos + len + 1);
+
+	va_start(vl, format);
+	vsnprintf(&reply[pos], len + 1, format, vl);
+	va_end(vl);
+
+	reply.resize(pos + len);
+}
+
+/* Names and contacts come from the network. Quotes, backslashes and
+ * control characters are escaped so that they can't end the field or the
+ * line, or pass for the OK closing the reply. */
+static void out_quoted(const char *field, const string &str) {
+	reply += field;
+	reply += " \"";
+
+	for (string::const_iterator i = str.begin(); i != str.end(); ++i) {
+		unsigned char c = *i;
+
+		if (c == '"' || c == '\\') {
+			reply += '\\';
+			reply += c;
+		} else if (c < 0x20 || c == 0x7f) {
+			char tmp[8];
+			snprintf(tmp, sizeof(tmp), "\\x%02x", c);
+			reply += tmp;
+		} else {
+			reply += c;
+		}
+	}
+
+	reply += '"';
+}
+
+static void drop_client(controlClient &c) {
+	close(c.sock);
+	c.sock = -1;
+	c.len = 0;
+}
+
+int ControlSetup(const char *path) {
+	sockaddr_un sa;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+
+	/* left behind by a previous run, but never remove anything else
+	 * that the path may name by mistake */
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			close(sock);
+			errno = EEXIST;
+			return -1;
+		}
+
+		unlink(path);
+	}
+
+	/* the socket is created with the owner's permissions only, there is
+	 * no window where others may connect */
+	mode_t mask = umask(S_IRWXG | S_IRWXO);
+	int res = bind(sock, (sockaddr *)&sa, sizeof(sa));
+	umask(mask);
+
+	if (res != 0
+		|| listen(sock, CONTROL_CLIENTS) != 0
+		|| fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != 0) {
+		int err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	for (int k = 0; k < CONTROL_CLIENTS; k++) {
+		clients[k].sock = -1;
+		clients[k].len = 0;
+	}
+
+	listenSock = sock;
+	return sock;
+}
+
+void ControlFds(fd_set &readset, int &maxfd) {
+	FD_SET(listenSock, &readset);
+	if (listenSock > maxfd)
+		maxfd = listenSock;
+
+	for (int k = 0; k < CONTROL_CLIENTS; k++) {
+		if (clients[k].sock < 0)
+			continue;
+
+		FD_SET(clients[k].sock, &readset);
+		if (clients[k].sock > maxfd)
+			maxfd = clients[k].sock;
+	}
+}
+
+/* ADDR[/PORT], without name resolution which would stall the loop. The
+ * port defaults to `defport', 0 for any. */
+static bool parse_numeric(const char *str, address &addr, const char *defport) {
+	char tmp[64];
+
+	if (strlen(str) >= sizeof(tmp))
+		return false;
+
+	strcpy(tmp, str);
+
+	char *port = strchr(tmp, '/');
+	if (port)
+		*port++ = 0;
+
+	addr.set_family(strchr(tmp, ':') ? AF_INET6 : AF_INET);
+	if (!addr.set_addr(tmp))
+		return false;
+
+	char *end;
+	unsigned long p = strtoul(port ? port : defport, &end, 10);
+	if (*end != 0 || (port && p == 0) || p > 65535)
+		return false;
+
+	return addr.set_port(p);
+}
+
+/* Sources send from ephemeral ports. Without one, as the address is
+ * typed, the whole table is looked through. */
+static const beaconSource *lookup_source(const address &addr) {
+	if (addr.port())
+		return find_source(addr);
+
+	for (Sources::const_iterator i = sources.begin(); i != sources.end(); ++i) {
+		if (i->first.is_equal(addr))
+			return &i->second;
+	}
+
+	return 0;
+}
+
+static const char *stats_line(const Stats &s, char *buf, size_t len) {
+	snprintf(buf, len, "ttl %i loss %.1f%% delay %.3f jitter %.3f ooo %.3f%% dup %.3f%%",
+		s.rttl, s.avgloss * 100, s.avgdelay, s.avgjitter, s.avgooo * 100,
+		s.avgdup * 100);
+	return buf;
+}
+
+static void out_stats(const char *indent, const char *channel, const Stats &s, uint64_t now) {
+	char tmp[160];
+
+	if (s.is_valid(now))
+		out("%s%s %s\n", indent, channel, stats_line(s, tmp, sizeof(tmp)));
+}
+
+static void cmd_source(int argc, char **argv) {
+	address addr;
+
+	if (argc != 2 || !parse_numeric(argv[1], addr, "0")) {
+		out("ERR usage: source ADDR[/PORT]\n");
+		return;
+	}
+
+	const beaconSource *src = lookup_source(addr);
+	if (src == 0) {
+		out("ERR unknown source\n");
+		return;
+	}
+
+	uint64_t now = get_timestamp();
+
+	out("source %s", src->addr.to_string().c_str());
+	if (src->identified)
+		out_quoted(" name", src->name);
+	if (!src->adminContact.empty())
+		out_quoted(" contact", src->adminContact);
+	out(" age %u\n", (uint32_t)((now - src->creation) / 1000));
+
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		const sessionSource *view = src->views[(*i)->index];
+		if (view == 0)
+			continue;
+
+		out("  group %s%s%s lastupdate %u reports %u\n", (*i)->name.c_str(),
+			(*i)->ifname.empty() ? "" : " on ", (*i)->ifname.c_str(),
+			(uint32_t)((now - view->lastevent) / 1000),
+			(uint32_t)view->externalSources.size());
+		out_stats("    ", "asm", view->ASM.s, now);
+		out_stats("    ", "ssm", view->SSM.s, now);
+	}
+
+	out("OK\n");
+}
+
+/* as FROM measures TO, FROM may be us */
+static void cmd_pair(int argc, char **argv) {
+	address from, to;
+
+	if (argc != 3 || !parse_numeric(argv[1], from, "0") || !parse_numeric(argv[2], to, "0")) {
+		out("ERR usage: pair FROM[/PORT] TO[/PORT]\n");
+		return;
+	}
+
+	bool fromLocal = IsLocalAddress(from), toLocal = IsLocalAddress(to);
+
+	const beaconSource *fromSrc = fromLocal ? 0 : lookup_source(from);
+	const beaconSource *toSrc = toLocal ? 0 : lookup_source(to);
+
+	if ((!fromLocal && fromSrc == 0) || (!toLocal && toSrc == 0)) {
+		out("ERR unknown source\n");
+		return;
+	}
+
+	if (fromLocal && toLocal) {
+		out("ERR both addresses are ours\n");
+		return;
+	}
+
+	uint64_t now = get_timestamp();
+
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		const beaconSession &session = **i;
+		const Stats *asmStats, *ssmStats;
+
+		if (fromLocal) {
+			const sessionSource *view = toSrc->views[session.index];
+			if (view == 0)
+				continue;
+
+			asmStats = &view->ASM.s;
+			ssmStats = &view->SSM.s;
+		} else {
+			const beaconExternalStats *ext = session.pairs.cell(fromSrc->id,
+				toLocal ? LOCAL_ID : toSrc->id);
+			if (ext == 0)
+				continue;
+
+			asmStats = &ext->ASM;
+			ssmStats = &ext->SSM;
+		}
+
+		out("  group %s%s%s\n", session.name.c_str(),
+			session.ifname.empty() ? "" : " on ", session.ifname.c_str());
+		out_stats("    ", "asm", *asmStats, now);
+		out_stats("    ", "ssm", *ssmStats, now);
+	}
+
+	out("OK\n");
+}
+
+static void cmd_interval(int argc, char **argv) {
+	string error;
+
+	if (argc == 1) {
+		double probe, report;
+		bool fixed;
+		uint32_t dump;
+
+		GetIntervals(probe, fixed, report, dump);
+
+		out("probe %.2f%s\n", probe, fixed ? "" : " auto");
+		out("report %.2f\n", report);
+		if (dump)
+			out("dump %u\n", dump);
+		out("OK\n");
+		return;
+	}
+
+	if (argc != 3) {
+		out("ERR usage: interval [probe|report|dump SECS]\n");
+		return;
+	}
+
+	char *end;
+	double secs = strcmp(argv[2], "auto") ? strtod(argv[2], &end) : 0;
+	if (strcmp(argv[2], "auto") && (*end != 0 || secs <= 0)) {
+		out("ERR bad interval\n");
+		return;
+	}
+
+	bool ok;
+
+	if (!strcmp(argv[1], "probe"))
+		ok = SetProbeInterval(secs, error);
+	else if (!strcmp(argv[1], "report"))
+		ok = SetReportInterval(secs, error);
+	else if (!strcmp(argv[1], "dump"))
+		ok = SetDumpInterval((uint32_t)secs, error);
+	else {
+		ok = false;
+		error = "unknown interval";
+	}
+
+	if (ok)
+		out("OK\n");
+	else
+		out("ERR %s\n", error.c_str());
+}
+
+static void cmd_bootstrap(int argc, char **argv) {
+	address addr;
+	string error;
+	bool ok;
+
+	if (argc != 3 || !parse_numeric(argv[2], addr, defaultPort)) {
+		out("ERR usage: bootstrap add|del ADDR[/PORT]\n");
+		return;
+	}
+
+	if (!strcmp(argv[1], "add"))
+		ok = AddBootstrap(addr, error);
+	else if (!strcmp(argv[1], "del"))
+		ok = RemoveBootstrap(addr, error);
+	else {
+		out("ERR usage: bootstrap add|del ADDR[/PORT]\n");
+		return;
+	}
+
+	if (ok)
+		out("OK\n");
+	else
+		out("ERR %s\n", error.c_str());
+}
+
+static void cmd_group(int argc, char **argv) {
+	address group;
+	string error;
+
+	if (argc < 3 || !parse_numeric(argv[2], group, defaultPort)) {
+		out("ERR usage: group add|del ADDR[/PORT] [ssm[=CHANNEL]] [interface=IF]\n");
+		return;
+	}
+
+	const char *ssm = 0, *ifname = 0;
+	bool useSSM = false;
+
+	for (int k = 3; k < argc; k++) {
+		if (!strcmp(argv[k], "ssm")) {
+			useSSM = true;
+		} else if (!strncmp(argv[k], "ssm=", 4)) {
+			address channel;
+			if (!parse_numeric(argv[k] + 4, channel, defaultPort)) {
+				out("ERR bad SSM channel\n");
+				return;
+			}
+			useSSM = true;
+			ssm = argv[k] + 4;
+		} else if (!strncmp(argv[k], "interface=", 10)) {
+			ifname = argv[k] + 10;
+		} else {
+			out("ERR unknown argument %s\n", argv[k]);
+			return;
+		}
+	}
+
+	bool ok;
+
+	if (!strcmp(argv[1], "add")) {
+		ok = AddSession(argv[2], ssm, useSSM, ifname, error);
+	} else if (!strcmp(argv[1], "del")) {
+		int ifindex = 0;
+		if (ifname && (ifindex = if_nametoindex(ifname)) == 0) {
+			out("ERR invalid interface name\n");
+			return;
+		}
+		ok = RemoveSession(group, ifindex, error);
+	} else {
+		out("ERR usage: group add|del ADDR[/PORT] [ssm[=CHANNEL]] [interface=IF]\n");
+		return;
+	}
+
+	if (ok)
+		out("OK\n");
+	else
+		out("ERR %s\n", error.c_str());
+}
+
+static void cmd_groups() {
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		const beaconSession &s = **i;
+
+		out("group %s", s.name.c_str());
+		if (!s.ifname.empty())
+			out(" interface %s", s.ifname.c_str());
+		if (!s.ssmProbeAddr.is_unspecified())
+			out(" ssm %s", s.ssmProbeAddr.to_string().c_str());
+		out(" sources %u\n", (uint32_t)s.sources.size());
+	}
+
+	out("OK\n");
+}
+
+static void cmd_help() {
+	out("source ADDR[/PORT]            stats of a source in each group\n");
+	out("pair FROM[/PORT] TO[/PORT]    what FROM reports of TO, FROM may be us\n");
+	out("groups                        list the beacon groups\n");
+	out("group add ADDR [ssm[=CHANNEL]] [interface=IF]\n");
+	out("group del ADDR [interface=IF]\n");
+	out("bootstrap add|del ADDR        SSM bootstrap addresses\n");
+	out("interval                      show the intervals\n");
+	out("interval probe|report SECS    set an interval, `auto' to follow the traffic\n");
+	out("interval dump SECS\n");
+	out("dump                          dump now\n");
+	out("quit\n");
+	out("OK\n");
+}
+
+/* returns false if the client is gone */
+static bool handle_line(controlClient &c, char *line) {
+	char *argv[CONTROL_ARGS], *save;
+	int argc = 0;
+
+	for (char *p = strtok_r(line, " \t\r", &save); p && argc < CONTROL_ARGS;
+			p = strtok_r(0, " \t\r", &save))
+		argv[argc++] = p;
+
+	if (argc == 0)
+		return true;
+
+	if (verbose > 1)
+		info("Control: %s", argv[0]);
+
+	reply.clear();
+
+	if (!strcmp(argv[0], "quit")) {
+		drop_client(c);
+		return false;
+	} else if (!strcmp(argv[0], "help")) {
+		cmd_help();
+	} else if (!strcmp(argv[0], "source")) {
+		cmd_source(argc, argv);
+	} else if (!strcmp(argv[0], "pair")) {
+		cmd_pair(argc, argv);
+	} else if (!strcmp(argv[0], "groups")) {
+		cmd_groups();
+	} else if (!strcmp(argv[0], "group")) {
+		cmd_group(argc, argv);
+	} else if (!strcmp(argv[0], "bootstrap")) {
+		cmd_bootstrap(argc, argv);
+	} else if (!strcmp(argv[0], "interval")) {
+		cmd_interval(argc, argv);
+	} else if (!strcmp(argv[0], "dump")) {
+		string error;
+		if (ForceDump(error))
+			out("OK\n");
+		else
+			out("ERR %s\n", error.c_str());
+	} else {
+		out("ERR unknown command, try `help'\n");
+	}
+
+	int len = send(c.sock, reply.data(), reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (len != (int)reply.size()) {
+		drop_client(c);
+		return false;
+	}
+
+	return true;
+}
+
+static void read_client(controlClient &c) {
+	int len = recv(c.sock, c.line + c.len, CONTROL_LINE - c.len, MSG_DONTWAIT);
+	if (len <= 0) {
+		if (len == 0 || (errno != EAGAIN && errno != EINTR))
+			drop_client(c);
+		return;
+	}
+
+	c.len += len;
+
+	char *nl;
+	while ((nl = (char *)memchr(c.line, '\n', c.len))) {
+		*nl = 0;
+
+		uint32_t used = nl - c.line + 1;
+
+		if (!handle_line(c, c.line))
+			return;
+
+		c.len -= used;
+		memmove(c.line, c.line + used, c.len);
+	}
+
+	if (c.len == CONTROL_LINE)
+		drop_client(c);
+}
+
+void ControlRead(const fd_set *readset) {
+	if (readset == 0 || FD_ISSET(listenSock, readset)) {
+		int sock;
+
+		while ((sock = accept(listenSock, 0, 0)) >= 0) {
+			int k = 0;
+			while (k < CONTROL_CLIENTS && clients[k].sock >= 0)
+				k++;
+
+			/* past what select() can watch */
+			if (k == CONTROL_CLIENTS || sock >= FD_SETSIZE) {
+				close(sock);
+				continue;
+			}
+
+			clients[k].sock = sock;
+			clients[k].len = 0;
+		}
+	}
+
+	for (int k = 0; k < CONTROL_CLIENTS; k++) {
+		if (clients[k].sock < 0)
+			continue;
+
+		if (readset == 0 || FD_ISSET(clients[k].sock, readset))
+			read_client(clients[k]);
+	}
+}
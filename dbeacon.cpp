@@ -30,7 +30,6 @@
 #include <ctype.h>
 #include <syslog.h>
 
-#include <assert.h>
 
 #include <map>
 #include <string>
@@ -75,6 +74,11 @@ enum {
 	SSM_SENDING_EVENT,
 	WILLSEND_SSM_EVENT,
 
+	SSM_JOIN_EVENT,
+
+	CONTROL_EVENT,
+	SAVE_STATE_EVENT,
+
 	// Report types
 	REPORT_EVENT = 'R',
 	SSM_REPORT_EVENT,
@@ -92,6 +96,9 @@ const char *TimerEventName[] = {
 	"New send probe process",
 	"SSM Send Probe",
 	"New SSM send probe process",
+	"Apply SSM joins",
+	"Serve control socket",
+	"Save state",
 
 	"Send Report",
 	"Send SSM Report",
@@ -102,7 +109,7 @@ const char *TimerEventName[] = {
 const char *EventName(int type) {
 	if (type < REPORT_EVENT)
 		return TimerEventName[type];
-	return TimerEventName[type - REPORT_EVENT + 8];
+	return TimerEventName[type - REPORT_EVENT + SAVE_STATE_EVENT + 1];
 }
 
 static const char *Flags[] = {
@@ -116,41 +123,87 @@ static uint32_t timeFact(int val, bool random = false);
 
 string beaconName, adminContact, twoLetterCC;
 Sources sources;
+Sessions sessions;
 WebSites webSites;
-address beaconUnicastAddr;
 int verbose = 0;
 uint32_t flags = 0;
 
-int mcastInterface = 0;
+int busyPoll = 0;
+
+static int pinCPU = -1;
+static int rtPriority = 0;
+static bool useUring = false;
+static bool multicastLoop = true;
+static string captureInterface;
+static int captureSock = -1;
+static string xdpInterface;
+static int xdpSock = -1;
+static string controlPath;
+static int controlSock = -1;
+/* warm restart snapshot, saved every stateSaveInterval ms and on exit */
+static string stateFile;
+static const uint32_t stateSaveInterval = 10000;
+/* whether sends are queued in io_uring */
+static bool uringActive = false;
+
+/* A session as given by -b and the -S, -O and -i that follow it */
+struct sessionConfig {
+	sessionConfig() : useSSM(false), listenForSSM(false), ifindex(0) {}
+
+	string addr, ssmAddr;
+	bool useSSM, listenForSSM;
+	int ifindex;
+	string ifname;
+};
+
+/* -S, -O and -i before any -b apply to every session */
+static sessionConfig defaultSessionConfig;
+static vector<sessionConfig> sessionConfigs;
 
-static char sessionName[256];
-static address probeAddr;
-static string probeAddrLiteral;
-static string probeSSMAddrLiteral;
-static bool useSSM = false;
-static bool listenForSSM = false;
 static bool useSSMPing = false;
-static address ssmProbeAddr;
-static int mcastSock, ssmMcastSock = 0;
+
+/* Probes and reports of each family and interface go out of their own
+ * socket, bound to our unicast address there */
+struct localEndpoint {
+	localEndpoint(int f, int i) : family(f), ifindex(i), sock(-1) {}
+
+	int family, ifindex;
+	int sock;
+	address addr;
+};
+
+typedef vector<localEndpoint *> LocalEndpoints;
+static LocalEndpoints locals;
+/* given with -s, for sessions without an interface */
+static address sourceAddrs[2];
+
+static localEndpoint *find_local(int family, int ifindex) {
+	for (LocalEndpoints::const_iterator i = locals.begin(); i != locals.end(); ++i) {
+		if ((*i)->family == family && (*i)->ifindex == ifindex)
+			return *i;
+	}
+
+	return 0;
+}
+/* session of each group socket, by descriptor */
+static vector<beaconSession *> socketSessions;
 static bool dumpBwReport = false;
 static string launchSomething;
 
 static double beacInt = 5.;
+/* set through the control socket, instead of following the traffic */
+static bool fixedBeaconInterval = false;
+/* period of the stats reports in ms, 0 for reportI times beacInt */
+static uint32_t reportInterval = 0;
 
 static uint64_t startTime = 0;
 
 static string dumpFile;
 
-typedef pair<address, bool> ContentDesc;
-typedef vector<ContentDesc> McastListen;
-static McastListen mcastListen;
-
 typedef pair<int, SocketHandler> SocketDesc;
 typedef set<SocketDesc> McastSocks;
 static McastSocks mcastSocks;
 
-static vector<address> redist;
-
 static vector<address> ssmBootstrap;
 
 static uint32_t bytesReceived = 0;
@@ -172,18 +225,25 @@ bool past_init = false;
 
 const char *pidfile = NULL;
 
+static uint32_t next_event_wait();
 static void next_event(timeval *);
-static void insert_event(uint32_t, uint32_t);
+static void insert_event(uint32_t, uint32_t, beaconSession * = 0);
+static void remove_events(uint32_t, const beaconSession *);
+static void set_session(int sock, beaconSession *);
 static void handle_event();
 static void handle_gc();
-static int send_probe();
-static int send_ssm_probe();
-static int send_report(int);
+static int send_probe(beaconSession &);
+static int send_ssm_probe(beaconSession &);
+static int send_report(beaconSession &, int);
 
 static void do_dump();
 static void do_bw_dump(bool);
 extern "C" void dumpBigBwStats(int);
-extern "C" void sendLeaveReport(int);
+extern "C" void leaveSignal(int);
+static void sendLeaveReport();
+
+/* set by SIGINT and SIGTERM, the event loops then leave */
+static volatile sig_atomic_t leaving = 0;
 
 static inline double Rand() {
 	double f = rand();
@@ -209,15 +269,18 @@ void usage() {
 	fprintf(stdout, "  -n NAME, -name NAME    Specifies the beacon name\n");
 	fprintf(stdout, "  -a MAIL                Supply administration contact\n");
 	fprintf(stdout, "  -i IN, -interface IN   Use IN instead of the default interface for multicast\n");
-	fprintf(stdout, "  -b BEACON_ADDR[/PORT]  Multicast group address to send probes to\n");
+	fprintf(stdout, "                         Applies like -S, a group may be given per interface\n");
+	fprintf(stdout, "  -b BEACON_ADDR[/PORT]  Multicast group address to send probes to, may be repeated\n");
 	fprintf(stdout, "  -S [GROUP_ADDR[/PORT]] Enables SSM reception/sending on optional GROUP_ADDR/PORT\n");
 	fprintf(stdout, "  -O                     Disables the joining of SSM groups but still sends via SSM.\n");
 	fprintf(stdout, "                         Use this option if your operating system has problems with SSM\n");
+	fprintf(stdout, "                         -S and -O apply to the last -b, or to all if given first\n");
 	fprintf(stdout, "  -B ADDR                Bootstraps by joining the specified address\n");
 	fprintf(stdout, "  -P, -ssmping           Enable the SSMPing server capability\n");
-	fprintf(stdout, "  -s ADDR                Bind to local address\n");
+	fprintf(stdout, "  -s ADDR                Bind to local address, once per family\n");
 	fprintf(stdout, "  -d [FILE]              Dump periodic reports to dump.xml or specified file\n");
 	fprintf(stdout, "  -I N, -interval N      Interval between dumps. Defaults to 5 secs\n");
+	fprintf(stdout, "  -R FILE, -state FILE   Keep sources and stats in FILE across restarts\n");
 	fprintf(stdout, "  -W URL, -website URL   Specify a website to announce.\n");
 	fprintf(stdout, "  -Wm URL, -matrix URL   Specify your matrix URL\n");
 	fprintf(stdout, "  -Wl URL, -lg URL       Specify your LG URL\n");
@@ -231,6 +294,26 @@ void usage() {
 	fprintf(stdout, "  -6, -ipv6              Force IPv6 usage\n");
 	fprintf(stdout, "  -v                     be verbose (use several for more verbosity)\n");
 	fprintf(stdout, "  -U                     Dump periodic bandwidth usage reports to stdout\n");
+	fprintf(stdout, "  -T S1,S2,S3            Statistics windows in seconds. Defaults to 10,60,300\n");
+	fprintf(stdout, "                         S2 is the one used in reports\n");
+	fprintf(stdout, "  -Jr N                  Join at most N new SSM sources per second. Defaults to 50\n");
+	fprintf(stdout, "  -Jl N                  Stay joined to SSM sources N secs after they are gone.\n");
+	fprintf(stdout, "                         Defaults to 60\n");
+	fprintf(stdout, "  -Ms N                  Keep at most N sources. Defaults to 2048\n");
+	fprintf(stdout, "  -Me N                  Keep at most N sources reported by each source.\n");
+	fprintf(stdout, "                         Defaults to 2048\n");
+	fprintf(stdout, "  -Bp [USECS]            Spin on the sockets instead of sleeping, with\n");
+	fprintf(stdout, "                         SO_BUSY_POLL set to USECS. Defaults to 50\n");
+	fprintf(stdout, "  -Bc CPU                Pin dbeacon to CPU\n");
+	fprintf(stdout, "  -Bf [PRIO]             Run under SCHED_FIFO with priority PRIO. Defaults to 1\n");
+	fprintf(stdout, "  -Bu                    Receive, send and wait through io_uring (Linux 6.0+)\n");
+	fprintf(stdout, "  -Bl                    Don't loop our probes and reports back to this host\n");
+	fprintf(stdout, "  -Ca IFACE              Listen only, capturing the beacon traffic seen on\n");
+	fprintf(stdout, "                         IFACE instead of joining groups (Linux)\n");
+	fprintf(stdout, "  -Bx IFACE              Receive the beacon port through AF_XDP on IFACE's\n");
+	fprintf(stdout, "                         first queue (Linux 5.9+)\n");
+	fprintf(stdout, "  -Cs PATH               Accept queries and reconfiguration on a UNIX\n");
+	fprintf(stdout, "                         socket at PATH, `help' lists the commands\n");
 	fprintf(stdout, "  -D, -daemon            fork to the background (daemonize)\n");
 	fprintf(stdout, "  -pidfile FILE          Specifies the PID filename to use\n");
 	fprintf(stdout, "  -syslog                Outputs using syslog facility.\n");
@@ -249,13 +332,17 @@ static void d_logv(int level, const char *format, va_list vl)
 	if (use_syslog && past_init) {
 		syslog(level, "%s",buffer);
 	} else {
-		char tbuf[64];
+		static char tbuf[64];
+		static time_t tbuf_sec = 0;
 		timeval tv;
 		gettimeofday(&tv, 0);
 
 		/* Some FreeBSDs' tv.tv_sec isn't time_t */
 		time_t tv_sec = tv.tv_sec;
-		strftime(tbuf, sizeof(tbuf), "%b %d %H:%M:%S", localtime(&tv_sec));
+		if (tv_sec != tbuf_sec) {
+			strftime(tbuf, sizeof(tbuf), "%b %d %H:%M:%S", localtime(&tv_sec));
+			tbuf_sec = tv_sec;
+		}
 
 		fprintf(stderr, "%s.%06u %s\n", tbuf, (uint32_t)tv.tv_usec, buffer);
 	}
@@ -293,20 +380,106 @@ extern "C" void waitForMe(int) {
 
 static void parse_arguments(int, char **);
 
-static inline bool IsSSMEnabled() {
-	return ssmMcastSock != 0;
+/* whether any session receives SSM */
+static bool IsSSMEnabled() {
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		if ((*i)->ssm_enabled())
+			return true;
+	}
+
+	return false;
+}
+
+static bool same_group(const address &a, const address &b) {
+	return a.is_equal(b) && a.port() == b.port();
+}
+
+/* Sessions without an interface receive from all of them */
+static bool same_interface(const beaconSession &a, const beaconSession &b) {
+	return a.ifindex == b.ifindex || a.ifindex == 0 || b.ifindex == 0;
+}
+
+static string session_label(const beaconSession &s) {
+	return s.ifname.empty() ? s.name : s.name + " on " + s.ifname;
+}
+
+/* The session `group' belongs to, either as its group or its SSM channel.
+ * A session without a group, when only listening, takes every group. */
+static beaconSession *session_for(const address &group)
+{
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		beaconSession *s = *i;
+
+		if (s->probeAddr.is_unspecified() || same_group(s->probeAddr, group)
+			|| (!s->ssmProbeAddr.is_unspecified() && same_group(s->ssmProbeAddr, group)))
+			return s;
+	}
+
+	return 0;
+}
+
+bool GroupOnOtherInterface(const address &group, int ifindex)
+{
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		const beaconSession *s = *i;
+
+		if (s->ifindex != ifindex && (same_group(s->probeAddr, group)
+			|| (!s->ssmProbeAddr.is_unspecified() && same_group(s->ssmProbeAddr, group))))
+			return true;
+	}
+
+	return false;
+}
+
+static inline beaconSession *session_of(int sock)
+{
+	return sock < (int)socketSessions.size() ? socketSessions[sock] : 0;
 }
 
 static void handle_asm(int sock, const Message &msg)
 {
+	beaconSession *s = session_of(sock);
+	if (s == 0)
+		return;
+
 	bytesReceived += msg.len;
-	handle_nmsg(msg.from, msg.timestamp, msg.ttl, msg.buffer, msg.len, false);
+	handle_nmsg(*s, msg.from, msg.timestamp, msg.ttl, msg.buffer, msg.len, false);
 }
 
 static void handle_ssm(int sock, const Message &msg)
 {
+	beaconSession *s = session_of(sock);
+	if (s == 0)
+		return;
+
+	bytesReceived += msg.len;
+	handle_nmsg(*s, msg.from, msg.timestamp, msg.ttl, msg.buffer, msg.len, true);
+}
+
+static void handle_capture(const Message &msg, bool ssm)
+{
+	if (IsLocalAddress(msg.from))
+		return;
+
+	beaconSession *s = session_for(msg.to);
+	if (s == 0)
+		return;
+
 	bytesReceived += msg.len;
-	handle_nmsg(msg.from, msg.timestamp, msg.ttl, msg.buffer, msg.len, true);
+	handle_nmsg(*s, msg.from, msg.timestamp, msg.ttl, msg.buffer, msg.len, ssm);
+}
+
+static void deliver_message(const SocketDesc &desc, const Message &msg)
+{
+	if (IsLocalAddress(msg.from))
+		return;
+
+	if (verbose > 3) {
+		char tmp[64];
+		info("RecvMsg(%s): len = %u", msg.from.to_string(tmp, sizeof(tmp)), (uint32_t)msg.len);
+	}
+
+	desc.second(desc.first, msg);
 }
 
 static void handle_mcast(const SocketDesc &desc)
@@ -318,145 +491,397 @@ static void handle_mcast(const SocketDesc &desc)
 	if (len < 0)
 		return;
 
-	if (msg.from.is_equal(beaconUnicastAddr))
-		return;
-
 	msg.buffer = buffer;
 	msg.len = len;
 
-	if (verbose > 3) {
-		char tmp[64];
-		info("RecvMsg(%s): len = %u", msg.from.to_string(tmp, sizeof(tmp)), len);
+	deliver_message(desc, msg);
+}
+
+/* Spins on the sockets instead of sleeping in select(), giving up a CPU
+ * to take the wakeup latency out of the measured delays */
+static void busy_poll_loop()
+{
+	static Message msgs[RECV_BATCH];
+	static uint8_t buffers[RECV_BATCH * bufferLen];
+
+	if (controlSock >= 0)
+		insert_event(CONTROL_EVENT, 100);
+
+	while (1) {
+		if (leaving)
+			sendLeaveReport();
+
+		update_clock();
+
+		for (McastSocks::const_iterator i = mcastSocks.begin();
+				i != mcastSocks.end(); ++i) {
+			int n = RecvMsgs(i->first, msgs, buffers, bufferLen, RECV_BATCH);
+
+			for (int k = 0; k < n; k++)
+				deliver_message(*i, msgs[k]);
+		}
+
+		if (captureSock >= 0)
+			CaptureRead(handle_capture);
+		if (xdpSock >= 0)
+			XdpRead(handle_capture);
+
+		handle_event();
 	}
+}
 
-	desc.second(desc.first, msg);
+static void uring_deliver(int sock, const Message &msg)
+{
+	for (McastSocks::const_iterator i = mcastSocks.begin();
+			i != mcastSocks.end(); ++i) {
+		if (i->first == sock) {
+			deliver_message(*i, msg);
+			return;
+		}
+	}
 }
 
-int main(int argc, char **argv) {
-	int res;
+/* Receives stay posted on the sockets, and sends and the wait for the next
+ * timer go through the same io_uring_enter(). Returns if the kernel turns
+ * the receives down, for the caller to go on with select() */
+static void uring_loop()
+{
+	for (McastSocks::const_iterator i = mcastSocks.begin();
+			i != mcastSocks.end(); ++i)
+		UringListen(i->first);
 
-	srand(time(NULL));
+	uringActive = true;
 
-	char tmp[256];
-	if (gethostname(tmp, sizeof(tmp)) != 0) {
-		perror("Failed to get hostname");
+	if (controlSock >= 0)
+		insert_event(CONTROL_EVENT, 100);
+
+	while (1) {
+		if (leaving)
+			sendLeaveReport();
+
+		if (UringWait(next_event_wait()) < 0 && errno != EINTR)
+			fatal("io_uring_enter failed: %s", strerror(errno));
+
+		update_clock();
+
+		if (UringDispatch(uring_deliver) < 0) {
+			UringClose();
+			uringActive = false;
+			remove_events(CONTROL_EVENT, 0);
+			return;
+		}
+
+		handle_event();
+	}
+}
+
+/* With several interfaces, the first one's */
+const address &LocalAddress(int family) {
+	static const address none;
+
+	for (LocalEndpoints::const_iterator i = locals.begin(); i != locals.end(); ++i) {
+		if ((*i)->family == family)
+			return (*i)->addr;
+	}
+
+	return none;
+}
+
+void LocalAddresses(int family, vector<address> &addrs) {
+	addrs.clear();
+
+	for (LocalEndpoints::const_iterator i = locals.begin(); i != locals.end(); ++i) {
+		if ((*i)->family == family)
+			addrs.push_back((*i)->addr);
+	}
+}
+
+bool IsLocalAddress(const address &addr) {
+	for (LocalEndpoints::const_iterator i = locals.begin(); i != locals.end(); ++i) {
+		if (addr.is_equal((*i)->addr))
+			return true;
+	}
+
+	return false;
+}
+
+/* Attaches again the filter of every group socket of the family, with all
+ * of the local addresses */
+static void refilter_sockets(int family)
+{
+	vector<address> self;
+	LocalAddresses(family, self);
+
+	for (int sock = 0; sock < (int)socketSessions.size(); sock++) {
+		const beaconSession *s = socketSessions[sock];
+
+		if (s && s->probeAddr.family() == family
+			&& !AttachBeaconFilter(sock, self) && errno != ENOSYS)
+			d_log(LOG_WARNING, "Failed to update the filter of socket %i: %s",
+				sock, strerror(errno));
+	}
+}
+
+/* Opens the socket of the session's family and interface, shared by every
+ * session there */
+static int setup_local_socket(const beaconSession &s)
+{
+	int family = s.probeAddr.family();
+
+	if (find_local(family, s.ifindex))
+		return 0;
+
+	localEndpoint *local = new localEndpoint(family, s.ifindex);
+
+	address any;
+	any.set_family(family);
+
+	local->sock = SetupSocket(any, false, false, 0);
+	if (local->sock < 0) {
+		delete local;
 		return -1;
 	}
 
-	beaconName = tmp;
+	if (s.ifindex && !SetMulticastInterface(local->sock, any, s.ifindex)) {
+		perror("Failed to set multicast interface");
+		goto fail;
+	}
 
-	parse_arguments(argc, argv);
+	if (s.ifindex == 0)
+		local->addr = sourceAddrs[family == AF_INET6 ? 1 : 0];
 
-	MulticastStartup();
+	if (local->addr.is_unspecified())
+		local->addr = get_local_address_for(s.probeAddr, s.ifindex);
 
-	if (beaconName.empty())
-		fatal("No name supplied, check `dbeacon -h`.");
+	if (bind(local->sock, local->addr.saddr(), local->addr.addrlen()) != 0) {
+		perror("Failed to bind local socket");
+		goto fail;
+	}
 
-	if (!probeAddrLiteral.empty()) {
-		if (!probeAddr.parse(probeAddrLiteral.c_str(), true))
-			return -1;
+	if (local->addr.fromsocket(local->sock) < 0) {
+		perror("getsockname");
+		goto fail;
+	}
 
-		probeAddr.to_string(sessionName, sizeof(sessionName));
+	if (!multicastLoop && !SetMulticastLoop(local->sock, local->addr, false))
+		d_log(LOG_WARNING, "Failed to disable multicast loopback: %s", strerror(errno));
 
-		if (!probeAddr.is_multicast())
-			fatal("Specified probe addr (%s) is not of a multicast group.",
-					sessionName);
+	locals.push_back(local);
 
-		if (adminContact.empty())
-			fatal("No administration contact supplied, check `dbeacon -h`.");
+	/* the group sockets already open must also drop what it sends */
+	refilter_sockets(family);
 
-		mcastListen.push_back(ContentDesc(probeAddr, false));
+	return 0;
 
-		insert_event(SENDING_EVENT, 100);
-		insert_event(REPORT_EVENT, 10000);
-		insert_event(MAP_REPORT_EVENT, 30000);
-		insert_event(WEBSITE_REPORT_EVENT, 120000);
+fail:
+	int err = errno;
+	close(local->sock);
+	delete local;
+	errno = err;
+	return -1;
+}
 
-		redist.push_back(probeAddr);
+/* Parses the session's groups and schedules its probes and reports. Returns
+ * NULL with `error' set if the groups are not usable. */
+static beaconSession *setup_session(sessionConfig &conf, uint32_t index, string &error)
+{
+	beaconSession *s = new beaconSession(index);
+
+	s->ifindex = conf.ifindex;
+	s->ifname = conf.ifname;
+
+	if (!s->probeAddr.parse(conf.addr.c_str(), true)) {
+		error = "Bad address format for beacon group.";
+	} else if (!s->probeAddr.is_multicast()) {
+		error = "Specified probe addr (" + s->probeAddr.to_string()
+			+ ") is not of a multicast group.";
+	} else if (adminContact.empty()) {
+		error = "No administration contact supplied, check `dbeacon -h`.";
+	} else {
+		s->name = s->probeAddr.to_string();
 
-		if (useSSM) {
-			if (probeSSMAddrLiteral.empty()) {
-				int family = forceFamily;
+		for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+			if (same_group((*i)->probeAddr, s->probeAddr) && same_interface(**i, *s))
+				error = "Beacon group " + s->name + " given twice for the same interface.";
+		}
+	}
 
-				if (family == AF_UNSPEC) {
-					family = probeAddr.family();
-				}
-				if (family == AF_INET) {
-					probeSSMAddrLiteral = defaultIPv4SSMChannel;
-				} else {
-					probeSSMAddrLiteral = defaultIPv6SSMChannel;
-				}
+	if (error.empty() && conf.useSSM) {
+		if (conf.ssmAddr.empty()) {
+			if (s->probeAddr.family() == AF_INET) {
+				conf.ssmAddr = defaultIPv4SSMChannel;
+			} else {
+				conf.ssmAddr = defaultIPv6SSMChannel;
 			}
+		}
 
-			if (!ssmProbeAddr.parse(probeSSMAddrLiteral.c_str(), true)) {
-				fatal("Bad address format for SSM channel.");
-			} else if (!ssmProbeAddr.is_unspecified()) {
-				insert_event(SSM_SENDING_EVENT, 100);
-				insert_event(SSM_REPORT_EVENT, 15000);
-
-				if (listenForSSM) {
-					mcastListen.push_back(ContentDesc(ssmProbeAddr, true));
-				}
+		if (!s->ssmProbeAddr.parse(conf.ssmAddr.c_str(), true)) {
+			error = "Bad address format for SSM channel.";
+		} else if (!s->ssmProbeAddr.is_unspecified()) {
+			for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+				if (same_group((*i)->ssmProbeAddr, s->ssmProbeAddr) && same_interface(**i, *s))
+					error = "SSM channel " + conf.ssmAddr + " used by two sessions,"
+						" give each one its own with -S.";
 			}
 		}
-	} else {
-		if (mcastListen.empty())
-			fatal("Nothing to do, check `dbeacon -h`.");
-		else
-			strcpy(sessionName, beaconName.c_str());
 	}
 
-	address local;
-	local.set_family(probeAddr.family());
+	if (!error.empty()) {
+		delete s;
+		return 0;
+	}
 
-	mcastSock = SetupSocket(local, false, false);
-	if (mcastSock < 0)
-		return -1;
+	insert_event(SENDING_EVENT, 100, s);
+	insert_event(REPORT_EVENT, 10000, s);
+	insert_event(MAP_REPORT_EVENT, 30000, s);
+	insert_event(WEBSITE_REPORT_EVENT, 120000, s);
 
-	if (beaconUnicastAddr.is_unspecified())
-		beaconUnicastAddr = get_local_address_for(probeAddr);
+	if (!s->ssmProbeAddr.is_unspecified()) {
+		insert_event(SSM_SENDING_EVENT, 100, s);
+		insert_event(SSM_REPORT_EVENT, 15000, s);
+	}
 
-	if (bind(mcastSock, beaconUnicastAddr.saddr(), beaconUnicastAddr.addrlen()) != 0) {
-		perror("Failed to bind local socket");
+	return s;
+}
+
+/* Opens the session's group sockets, after the local ones. Group sockets
+ * filter out our own traffic, so the local addresses go first. */
+static int open_session(beaconSession *s, bool listenForSSM)
+{
+	if (setup_local_socket(*s) < 0)
+		return -1;
+
+	int sock = SetupSocket(s->probeAddr, true, false, s->ifindex);
+	if (sock < 0)
 		return -1;
+
+	set_session(sock, s);
+	ListenTo(sock, handle_asm);
+
+	if (!s->ssmProbeAddr.is_unspecified() && listenForSSM) {
+		sock = SetupSocket(s->ssmProbeAddr, true, true, s->ifindex);
+		if (sock < 0)
+			return -1;
+
+		set_session(sock, s);
+		ListenTo(sock, handle_ssm);
+		s->ssmSock = sock;
+		SSMJoinSetup(sock, s->ssmProbeAddr, s->ifindex, handle_ssm);
 	}
 
-	if (beaconUnicastAddr.fromsocket(mcastSock) < 0) {
-		perror("getsockname");
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int res;
+
+	srand(time(NULL));
+
+	update_clock();
+
+	char tmp[256];
+	if (gethostname(tmp, sizeof(tmp)) != 0) {
+		perror("Failed to get hostname");
 		return -1;
 	}
 
-	for (McastListen::const_iterator i = mcastListen.begin();
-			i != mcastListen.end(); ++i) {
-		int sock = SetupSocket(i->first, true, i->second);
-		if (sock < 0)
+	beaconName = tmp;
+
+	parse_arguments(argc, argv);
+
+	MulticastStartup();
+
+	if (beaconName.empty())
+		fatal("No name supplied, check `dbeacon -h`.");
+
+	if (!sessionConfigs.empty() && !captureInterface.empty())
+		fatal("Capturing is only supported when listening, without -b.");
+
+	if (sessionConfigs.size() > MAX_SESSIONS)
+		fatal("At most %u sessions are supported.", MAX_SESSIONS);
+
+	for (uint32_t k = 0; k < sessionConfigs.size(); k++) {
+		string error;
+		beaconSession *s = setup_session(sessionConfigs[k], k, error);
+		if (!s)
+			fatal("%s", error.c_str());
+		sessions.push_back(s);
+	}
+
+	if (sessions.empty()) {
+		if (captureInterface.empty())
+			fatal("Nothing to do, check `dbeacon -h`.");
+
+		/* a single session taking whatever is captured */
+		beaconSession *s = new beaconSession(0);
+		s->name = beaconName;
+		sessions.push_back(s);
+	}
+
+	/* nothing is sent when only capturing */
+	for (uint32_t k = 0; k < sessionConfigs.size(); k++) {
+		if (open_session(sessions[k], sessionConfigs[k].listenForSSM) < 0)
 			return -1;
+	}
 
-		if (i->second) {
-			ListenTo(sock, handle_ssm);
-			ssmMcastSock = sock;
-		} else {
-			ListenTo(sock, handle_asm);
-		}
+	if (!captureInterface.empty()) {
+		captureSock = CaptureSetup(captureInterface.c_str());
+		if (captureSock < 0)
+			fatal("Failed to capture on %s: %s", captureInterface.c_str(), strerror(errno));
+	}
+
+	/* the groups stay joined through the sockets above, which no longer
+	 * see what is steered to the XDP socket */
+	if (!xdpInterface.empty()) {
+		const address &group = sessions.front()->probeAddr;
+		int port = group.is_unspecified() ? atoi(defaultPort) : group.port();
+
+		xdpSock = XdpSetup(xdpInterface.c_str(), port);
+		if (xdpSock < 0)
+			fatal("Failed to setup AF_XDP on %s: %s", xdpInterface.c_str(), strerror(errno));
+	}
+
+	if (!controlPath.empty()) {
+		controlSock = ControlSetup(controlPath.c_str());
+		if (controlSock < 0)
+			fatal("Failed to setup control socket %s: %s", controlPath.c_str(),
+				strerror(errno));
 	}
 
 	if (useSSMPing) {
-		if (SetupSSMPing() < 0)
-			d_log(LOG_ERR, "Failed to setup SSM Ping.");
-		else
-			flags |= SSMPING_CAPABLE;
+		static const int families[] = { AF_INET, AF_INET6 };
+
+		for (int k = 0; k < 2; k++) {
+			if (LocalAddress(families[k]).is_unspecified())
+				continue;
+
+			if (SetupSSMPing(families[k]) < 0)
+				d_log(LOG_ERR, "Failed to setup SSM Ping.");
+			else
+				flags |= SSMPING_CAPABLE;
+		}
 	}
 
 	if (IsSSMEnabled()) {
 		flags |= SSM_CAPABLE;
 
+		insert_event(SSM_JOIN_EVENT, 1000);
+
 		uint64_t now = get_timestamp();
 		for (vector<address>::const_iterator i = ssmBootstrap.begin();
-				i != ssmBootstrap.end(); ++i)
-			getSource(*i, 0, now, 0, false);
+				i != ssmBootstrap.end(); ++i) {
+			for (Sessions::const_iterator j = sessions.begin(); j != sessions.end(); ++j) {
+				if ((*j)->ssm_enabled() && (*j)->probeAddr.family() == i->family())
+					getSessionSource(**j, *i, 0, now, 0, false);
+			}
+		}
 	} else if (!ssmBootstrap.empty())
 		d_log(LOG_WARNING, "Tried to bootstrap using SSM when SSM is not enabled.");
 
+	/* after the SSM channels are registered, restored sources are joined */
+	if (!stateFile.empty())
+		LoadState(stateFile.c_str(), timeFact(timeOutI));
+
 	if (daemonize || use_syslog) {
 		use_syslog = true;
 		openlog("dbeacon", LOG_NDELAY | LOG_PID, LOG_DAEMON);
@@ -471,6 +896,12 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (pinCPU >= 0 && !SetCPUAffinity(pinCPU))
+		d_log(LOG_WARNING, "Failed to pin to CPU %i: %s", pinCPU, strerror(errno));
+
+	if (rtPriority > 0 && !SetRealtimePriority(rtPriority))
+		d_log(LOG_WARNING, "Failed to switch to SCHED_FIFO: %s", strerror(errno));
+
 	// Init timer events
 	insert_event(GARBAGE_COLLECT_EVENT, 30000);
 
@@ -482,38 +913,102 @@ int main(int argc, char **argv) {
 	if (dumpBwReport)
 		insert_event(DUMP_BIG_BW_EVENT, 600000);
 
-	info("Local name is `%s` [Beacon group: %s, Local address: %s]",
-		beaconName.c_str(), sessionName, beaconUnicastAddr.to_string(tmp, sizeof(tmp), false));
+	if (!stateFile.empty())
+		insert_event(SAVE_STATE_EVENT, stateSaveInterval);
 
-	send_report(WEBSITE_REPORT_EVENT);
+	string groups;
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		if (!groups.empty())
+			groups += ", ";
+		groups += session_label(**i);
+	}
+
+	string localAddrs;
+	for (LocalEndpoints::const_iterator i = locals.begin(); i != locals.end(); ++i) {
+		if (!localAddrs.empty())
+			localAddrs += ", ";
+		localAddrs += (*i)->addr.to_string(tmp, sizeof(tmp), false);
+	}
+
+	info("Local name is `%s` [Beacon group%s: %s, Local address%s: %s]",
+		beaconName.c_str(), sessions.size() > 1 ? "s" : "", groups.c_str(),
+		locals.size() > 1 ? "es" : "", localAddrs.c_str());
+
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		if (!(*i)->probeAddr.is_unspecified())
+			send_report(**i, WEBSITE_REPORT_EVENT);
+	}
 
 	signal(SIGUSR1, dumpBigBwStats);
-	signal(SIGINT, sendLeaveReport);
-	signal(SIGTERM, sendLeaveReport);
+	signal(SIGINT, leaveSignal);
+	signal(SIGTERM, leaveSignal);
 
 	signal(SIGCHLD, waitForMe); // bloody fork, we dont want to wait for thee
 
 	startTime = lastDumpBwTS = lastDumpDumpBwTS = get_timestamp();
 
+	if (useUring && (captureSock >= 0 || xdpSock >= 0)) {
+		d_log(LOG_WARNING, "io_uring is not used with -Ca or -Bx.");
+		useUring = false;
+	}
+
+	if (useUring) {
+		if (UringSetup(bufferLen))
+			uring_loop();
+
+		d_log(LOG_WARNING, "io_uring not available, using select(): %s", strerror(errno));
+	}
+
+	if (busyPoll)
+		busy_poll_loop();
+
 	while (1) {
 		fd_set readset;
 		timeval eventm;
 
+		if (leaving)
+			sendLeaveReport();
+
 		FD_ZERO(&readset);
 
+		int maxfd = max(captureSock, xdpSock);
+		if (captureSock >= 0)
+			FD_SET(captureSock, &readset);
+		if (xdpSock >= 0)
+			FD_SET(xdpSock, &readset);
+
 		for (McastSocks::const_iterator i = mcastSocks.begin();
-				i != mcastSocks.end(); ++i)
+				i != mcastSocks.end(); ++i) {
 			FD_SET(i->first, &readset);
+			if (i->first > maxfd)
+				maxfd = i->first;
+		}
+
+		if (controlSock >= 0)
+			ControlFds(readset, maxfd);
 
 		next_event(&eventm);
 
-		res = select(mcastSocks.rbegin()->first + 1, &readset, 0, 0, &eventm);
+		res = select(maxfd + 1, &readset, 0, 0, &eventm);
+
+		/* one reading for the whole batch of packets */
+		update_clock();
 
 		if (res < 0) {
 			if (errno == EINTR)
 				continue;
 			fatal("Select failed: %s", strerror(errno));
 		} else {
+			if (captureSock >= 0 && FD_ISSET(captureSock, &readset)) {
+				CaptureRead(handle_capture);
+				res--;
+			}
+
+			if (xdpSock >= 0 && FD_ISSET(xdpSock, &readset)) {
+				XdpRead(handle_capture);
+				res--;
+			}
+
 			for (McastSocks::const_iterator i = mcastSocks.begin();
 					res > 0 && i != mcastSocks.end(); ++i) {
 				if (FD_ISSET(i->first, &readset)) {
@@ -522,6 +1017,10 @@ int main(int argc, char **argv) {
 				}
 			}
 
+			/* commands may close sockets, after we are done with them */
+			if (controlSock >= 0 && res > 0)
+				ControlRead(&readset);
+
 			handle_event();
 		}
 	}
@@ -529,9 +1028,25 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
-void ListenTo(int sock, SocketHandler handler)
+/* The same group may be joined on several interfaces, so the session
+ * of a socket is told and not looked up from what it is bound to */
+static void set_session(int sock, beaconSession *s)
+{
+	if (sock >= (int)socketSessions.size())
+		socketSessions.resize(sock + 1, (beaconSession *)0);
+	socketSessions[sock] = s;
+}
+
+void ListenTo(int sock, SocketHandler handler, int sibling)
 {
 	mcastSocks.insert(SocketDesc(sock, handler));
+
+	if (sibling >= 0)
+		set_session(sock, session_of(sibling));
+
+	/* sockets opened once running, for new SSM sources or sessions */
+	if (uringActive)
+		UringListen(sock);
 }
 
 void show_version() {
@@ -579,6 +1094,20 @@ enum {
 	DAEMON,
 	PIDFILE,
 	USE_SYSLOG,
+	STATSWINDOWS,
+	SSMJOINRATE,
+	SSMLEAVEDELAY,
+	MAXSOURCES,
+	MAXEXTERNAL,
+	BUSYPOLL,
+	PINCPU,
+	RTPRIORITY,
+	IOURING,
+	NOLOOP,
+	CAPTURE,
+	XDP,
+	CONTROL,
+	STATEFILE,
 	CONFFILE
 };
 
@@ -618,6 +1147,20 @@ static const struct param_tok {
 	{ DAEMON,	"D", "daemon", NO_ARG },
 	{ PIDFILE,	"p", "pidfile", REQ_ARG },
 	{ USE_SYSLOG,	"Y", "syslog", NO_ARG },
+	{ STATSWINDOWS,	"T", "stats_windows", REQ_ARG },
+	{ SSMJOINRATE,	"Jr", "ssm_join_rate", REQ_ARG },
+	{ SSMLEAVEDELAY,"Jl", "ssm_leave_delay", REQ_ARG },
+	{ MAXSOURCES,	"Ms", "max_sources", REQ_ARG },
+	{ MAXEXTERNAL,	"Me", "max_external", REQ_ARG },
+	{ BUSYPOLL,	"Bp", "busy_poll", OPT_ARG },
+	{ PINCPU,	"Bc", "cpu", REQ_ARG },
+	{ RTPRIORITY,	"Bf", "fifo", OPT_ARG },
+	{ IOURING,	"Bu", "io_uring", NO_ARG },
+	{ NOLOOP,	"Bl", "no_loop", NO_ARG },
+	{ CAPTURE,	"Ca", "capture", REQ_ARG },
+	{ XDP,		"Bx", "xdp", REQ_ARG },
+	{ CONTROL,	"Cs", "control", REQ_ARG },
+	{ STATEFILE,	"R", "state", REQ_ARG },
 	{ CONFFILE,	"c", NULL, REQ_ARG },
 	{ SHOWVERSION,	"V", "version", NO_ARG },
 	{ 0, NULL, NULL, 0 }
@@ -658,12 +1201,34 @@ static uint32_t parse_u32(const char *name, const char *arg) {
 	return result;
 }
 
-static bool parse_bool(const char *name, const char *arg, bool def) {
-	if (arg == NULL)
-		return def;
+static void parse_windows(const char *arg) {
+	const char *p = arg;
 
-	if (!strcasecmp(arg, "yes"))
-		return true;
+	for (int k = 0; k < STATS_WINDOWS; k++) {
+		char *end;
+
+		statsWindows[k] = strtoul(p, &end, 10);
+		if (statsWindows[k] < 1 || statsWindows[k] > STATS_HISTORY)
+			fatal("Stats windows: Expected values between 1 and %u.", STATS_HISTORY);
+		if (k > 0 && statsWindows[k] < statsWindows[k - 1])
+			fatal("Stats windows: Windows must be in increasing order.");
+
+		if (k < (STATS_WINDOWS - 1)) {
+			if (end[0] != ',')
+				fatal("Stats windows: Expected %u comma separated values.", STATS_WINDOWS);
+			p = end + 1;
+		} else if (end[0] != 0) {
+			fatal("Stats windows: Expected %u comma separated values.", STATS_WINDOWS);
+		}
+	}
+}
+
+static bool parse_bool(const char *name, const char *arg, bool def) {
+	if (arg == NULL)
+		return def;
+
+	if (!strcasecmp(arg, "yes"))
+		return true;
 	else if (!strcasecmp(arg, "true"))
 		return true;
 	else if (!strcasecmp(arg, "1"))
@@ -693,22 +1258,37 @@ static void process_param(const param_tok *tok, const char *arg) {
 		adminContact = check_good_string("admin contact", arg);
 		break;
 	case INTERFACE:
-		mcastInterface = if_nametoindex(arg);
-		if (mcastInterface <= 0)
-			fatal("Invalid interface name.");
+		{
+			sessionConfig &conf = sessionConfigs.empty() ?
+				defaultSessionConfig : sessionConfigs.back();
+
+			conf.ifindex = if_nametoindex(arg);
+			if (conf.ifindex <= 0)
+				fatal("Invalid interface name.");
+			conf.ifname = arg;
+		}
 		break;
 	case BEACONADDR:
-		probeAddrLiteral = arg;
+		sessionConfigs.push_back(defaultSessionConfig);
+		sessionConfigs.back().addr = arg;
 		break;
 	case SSMADDR:
-		if (arg)
-			probeSSMAddrLiteral = arg;
-		useSSM = true;
-		listenForSSM = true;
+		{
+			sessionConfig &conf = sessionConfigs.empty() ?
+				defaultSessionConfig : sessionConfigs.back();
+			if (arg)
+				conf.ssmAddr = arg;
+			conf.useSSM = true;
+			conf.listenForSSM = true;
+		}
 		break;
 	case SSMSENDONLY:
-		useSSM = true;
-		listenForSSM = parse_bool("SSMSendOnly", arg, false);
+		{
+			sessionConfig &conf = sessionConfigs.empty() ?
+				defaultSessionConfig : sessionConfigs.back();
+			conf.useSSM = true;
+			conf.listenForSSM = parse_bool("SSMSendOnly", arg, false);
+		}
 		break;
 	case BOOTSTRAP:
 		add_bootstrap_address(arg);
@@ -717,7 +1297,11 @@ static void process_param(const param_tok *tok, const char *arg) {
 		useSSMPing = parse_bool("SSMPing", arg, true);
 		break;
 	case SOURCEADDR:
-		parse_or_fail(&beaconUnicastAddr, arg, false, false);
+		{
+			address addr;
+			parse_or_fail(&addr, arg, false, false);
+			sourceAddrs[addr.family() == AF_INET6 ? 1 : 0] = addr;
+		}
 		break;
 	case DUMP:
 		dumpFile = arg ? arg : defaultDumpFile;
@@ -792,6 +1376,48 @@ static void process_param(const param_tok *tok, const char *arg) {
 	case USE_SYSLOG:
 		use_syslog = true;
 		break;
+	case STATSWINDOWS:
+		parse_windows(arg);
+		break;
+	case SSMJOINRATE:
+		ssmJoinRate = parse_u32("SSM join rate", arg);
+		break;
+	case SSMLEAVEDELAY:
+		ssmLeaveDelay = parse_u32("SSM leave delay", arg);
+		break;
+	case MAXSOURCES:
+		maxSources = parse_u32("Max sources", arg);
+		break;
+	case MAXEXTERNAL:
+		maxExternalSources = parse_u32("Max external sources", arg);
+		break;
+	case BUSYPOLL:
+		busyPoll = arg ? parse_u32("Busy poll", arg) : 50;
+		break;
+	case PINCPU:
+		pinCPU = parse_u32("CPU", arg);
+		break;
+	case RTPRIORITY:
+		rtPriority = arg ? parse_u32("SCHED_FIFO priority", arg) : 1;
+		break;
+	case IOURING:
+		useUring = true;
+		break;
+	case NOLOOP:
+		multicastLoop = false;
+		break;
+	case CAPTURE:
+		captureInterface = arg;
+		break;
+	case XDP:
+		xdpInterface = arg;
+		break;
+	case CONTROL:
+		controlPath = arg;
+		break;
+	case STATEFILE:
+		stateFile = arg;
+		break;
 	case CONFFILE:
 		parse_config_file(arg);
 		break;
@@ -920,106 +1546,117 @@ void parse_arguments(int argc, char **argv) {
 
 struct timer {
 	uint32_t type, interval;
-	uint32_t target;
+	/* absolute, in get_timestamp() time */
+	uint64_t deadline;
+	/* for probes and reports, NULL for the others */
+	beaconSession *session;
 };
 
-typedef std::list<timer> tq_def;
+/* events are rescheduled all the time, keep their nodes in a pool */
+typedef std::list<timer, poolAllocator<timer> > tq_def;
 static tq_def timers;
 
-/* accumulated time waiting to be spent by events */
-static uint32_t taccum = 0;
-static uint64_t lastclk = 0;
+/* deadline of the event being handled. Events it schedules are relative
+ * to it instead of to the time it ran, so that periodic events, probes
+ * in particular, don't drift when the loop is late. */
+static uint64_t scheduleBase = 0;
+
+/* how late probes were sent, in ms */
+static Histogram probeLateness;
+static uint64_t probesScheduled = 0;
 
-static void update_taccum() {
+uint32_t next_event_wait() {
 	uint64_t now = get_timestamp();
-	int32_t diff = now - (int64_t)lastclk;
 
-	assert(now >= lastclk);
+	/* we assume we always have a timer in the list */
+	uint64_t deadline = timers.begin()->deadline;
 
-	lastclk = now;
-	taccum += diff;
+	return deadline > now ? deadline - now : 0;
 }
 
 void next_event(timeval *eventm) {
-	update_taccum();
-
-	timer &h = *timers.begin();
-
-	/* we assume we always have a timer in the list */
-	if (taccum > h.target) {
-		taccum -= h.target;
-		h.target = 0;
-	} else {
-		h.target -= taccum;
-		taccum = 0;
-	}
+	uint32_t wait = next_event_wait();
 
-	eventm->tv_sec = h.target / 1000;
-	eventm->tv_usec = (h.target % 1000) * 1000;
+	eventm->tv_sec = wait / 1000;
+	eventm->tv_usec = (wait % 1000) * 1000;
 }
 
 void insert_sorted_event(timer &t) {
-	uint32_t accum = 0;
-
-	tq_def::iterator i = timers.begin();
-
-	while (1) {
-		if (i == timers.end() || (accum + i->target) >= t.interval)
-			break;
-		accum += i->target;
-		++i;
-	}
+	uint64_t now = get_timestamp();
 
-	t.target = t.interval - accum;
+	t.deadline = (scheduleBase ? scheduleBase : now) + t.interval;
 
-	if (i != timers.end())
-		i->target -= t.target;
+	/* after a long stall, resume instead of catching up */
+	if (t.deadline < now)
+		t.deadline = now;
 
-	if (timers.empty()) {
-		lastclk = get_timestamp();
-		taccum = 0;
-	}
+	tq_def::iterator i = timers.begin();
+	while (i != timers.end() && i->deadline <= t.deadline)
+		++i;
 
 	timers.insert(i, t);
 }
 
-void insert_event(uint32_t type, uint32_t interval) {
+void insert_event(uint32_t type, uint32_t interval, beaconSession *session) {
 	timer t;
 	t.type = type;
 	t.interval = interval;
+	t.session = session;
 
 	insert_sorted_event(t);
 }
 
-static int send_count = 0;
-static int send_ssm_count = 0;
-
 uint32_t timeFact(int val, bool random) {
 	return (uint32_t) ((random ? ceil(Exprnd(beacInt * val)) : (beacInt * val)) * 1000);
 }
 
+/* reports keep their proportions when their interval is set */
+static uint32_t report_period(int val) {
+	if (reportInterval)
+		return reportInterval * val / reportI;
+	return timeFact(val);
+}
+
 static void handle_single_event() {
 	timer t = *timers.begin();
 	timers.erase(timers.begin());
 
+	scheduleBase = t.deadline;
+
+	beaconSession *s = t.session;
+
+	if (t.type == SENDING_EVENT || t.type == SSM_SENDING_EVENT) {
+		probeLateness.add(get_timestamp() - t.deadline);
+		probesScheduled++;
+	}
+
 	switch (t.type) {
 	case SENDING_EVENT:
-		send_probe();
-		send_count++;
+		send_probe(*s);
+		s->sendCount++;
 		break;
 	case SSM_SENDING_EVENT:
-		send_ssm_probe();
-		send_ssm_count++;
+		send_ssm_probe(*s);
+		s->ssmSendCount++;
 		break;
 	case REPORT_EVENT:
 	case SSM_REPORT_EVENT:
 	case MAP_REPORT_EVENT:
 	case WEBSITE_REPORT_EVENT:
-		send_report(t.type);
+		send_report(*s, t.type);
 		break;
 	case GARBAGE_COLLECT_EVENT:
 		handle_gc();
 		break;
+	case SSM_JOIN_EVENT:
+		ApplySSMJoins();
+		break;
+	case CONTROL_EVENT:
+		ControlRead(0);
+		break;
+	case SAVE_STATE_EVENT:
+		SaveState(stateFile.c_str());
+		break;
 	case DUMP_EVENT:
 		do_dump();
 		break;
@@ -1030,37 +1667,37 @@ static void handle_single_event() {
 	}
 
 	if (t.type == WILLSEND_EVENT) {
-		insert_event(SENDING_EVENT, 100);
-		send_count = 0;
+		insert_event(SENDING_EVENT, 100, s);
+		s->sendCount = 0;
 	} else if (t.type == WILLSEND_SSM_EVENT) {
-		insert_event(SSM_SENDING_EVENT, 100);
-		send_ssm_count = 0;
-	} else if (t.type == SENDING_EVENT && send_count == probeBurstLength) {
-		insert_event(WILLSEND_EVENT, timeFact(1, true));
-	} else if (t.type == SSM_SENDING_EVENT && send_ssm_count == probeBurstLength) {
-		insert_event(WILLSEND_SSM_EVENT, timeFact(1, true));
+		insert_event(SSM_SENDING_EVENT, 100, s);
+		s->ssmSendCount = 0;
+	} else if (t.type == SENDING_EVENT && s->sendCount == probeBurstLength) {
+		insert_event(WILLSEND_EVENT, timeFact(1, true), s);
+	} else if (t.type == SSM_SENDING_EVENT && s->ssmSendCount == probeBurstLength) {
+		insert_event(WILLSEND_SSM_EVENT, timeFact(1, true), s);
 	} else if (t.type == REPORT_EVENT) {
-		insert_event(REPORT_EVENT, timeFact(reportI));
+		insert_event(REPORT_EVENT, report_period(reportI), s);
 	} else if (t.type == SSM_REPORT_EVENT) {
-		insert_event(SSM_REPORT_EVENT, timeFact(ssmReportI));
+		insert_event(SSM_REPORT_EVENT, report_period(ssmReportI), s);
 	} else if (t.type == MAP_REPORT_EVENT) {
-		insert_event(MAP_REPORT_EVENT, timeFact(mapReportI));
+		insert_event(MAP_REPORT_EVENT, report_period(mapReportI), s);
 	} else if (t.type == WEBSITE_REPORT_EVENT) {
-		insert_event(WEBSITE_REPORT_EVENT, timeFact(websiteReportI));
+		insert_event(WEBSITE_REPORT_EVENT, report_period(websiteReportI), s);
 	} else {
 		insert_sorted_event(t);
 	}
+
+	scheduleBase = 0;
 }
 
 void handle_event() {
-	update_taccum();
-
 	while (!timers.empty()) {
-		if (timers.begin()->target > taccum) {
-			return;
-		}
+		/* events before us may have taken a while */
+		update_clock();
 
-		taccum -= timers.begin()->target;
+		if (timers.begin()->deadline > get_timestamp())
+			return;
 
 		handle_single_event();
 	}
@@ -1070,34 +1707,105 @@ static inline bool isStillValid(uint64_t now, uint64_t last_event) {
 	return (now - last_event) <= timeFact(timeOutI);
 }
 
+/* both lists are ordered by last activity, so we stop at the first
+ * entry that is still alive */
+static ageList sourceAge, externalAge;
+
 void handle_gc() {
 	uint64_t now = get_timestamp();
 
-	Sources::iterator i = sources.begin();
-	while (i != sources.end()) {
-		Sources::iterator k = i;
-		i++;
-
-		if (isStillValid(now, k->second.lastevent)) {
-			k->second.ASM.s.check_validity(now);
-			k->second.SSM.s.check_validity(now);
-
-			beaconSource::ExternalSources::iterator j = k->second.externalSources.begin();
-			while (j != k->second.externalSources.end()) {
-				beaconSource::ExternalSources::iterator m = j;
-				j++;
-
-				if (isStillValid(now, m->second.lastupdate)) {
-					m->second.ASM.check_validity(now);
-					m->second.SSM.check_validity(now);
-				} else {
-					k->second.externalSources.erase(m);
-				}
-			}
-		} else {
-			removeSource(k->first, true);
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		beaconSession &session = **i;
+
+		session.pairs.prepare();
+
+		while (!session.sourceAge.empty()) {
+			sessionSource *view = static_cast<sessionSource *>(session.sourceAge.first());
+			if (isStillValid(now, view->lastevent))
+				break;
+
+			address addr = view->source->addr;
+			removeSessionSource(session, addr, true);
 		}
 	}
+
+	while (!sourceAge.empty()) {
+		beaconSource *src = static_cast<beaconSource *>(sourceAge.first());
+		if (isStillValid(now, src->lastevent))
+			break;
+
+		address addr = src->addr;
+		removeSource(addr, true);
+	}
+
+	while (!externalAge.empty()) {
+		beaconExternalStats *ext =
+			static_cast<beaconExternalStats *>(externalAge.first());
+		if (isStillValid(now, ext->lastupdate))
+			break;
+
+		ext->owner->session->pairs.clear(ext);
+
+		sessionSource::ExternalSources &ext_map = ext->owner->externalSources;
+		ext_map.erase(ext_map.find(*ext->key));
+	}
+}
+
+nodePool *nodePool::pools = 0;
+
+nodePool::nodePool(size_t sz)
+	: reserved(0), inuse(0), freelist(0), slabpos(0), slabend(0) {
+	/* keep nodes aligned for any of their members */
+	const size_t align = 2 * sizeof(void *);
+
+	size = ((sz < sizeof(void *) ? sizeof(void *) : sz) + align - 1) & ~(align - 1);
+
+	next = pools;
+	pools = this;
+}
+
+void nodePool::grow() {
+	size_t count = POOL_SLAB_BYTES / size;
+	if (count < 8)
+		count = 8;
+
+	slabpos = (char *)::operator new(count * size);
+	slabend = slabpos + count * size;
+	reserved += count;
+}
+
+void pool_usage(size_t &reserved, size_t &used) {
+	reserved = used = 0;
+
+	for (nodePool *p = nodePool::pools; p; p = p->next) {
+		reserved += p->reserved * p->size;
+		used += p->inuse * p->size;
+	}
+}
+
+void ageLink::unlink() {
+	if (next) {
+		prev->next = next;
+		next->prev = prev;
+		prev = next = 0;
+	}
+}
+
+ageList::ageList() {
+	head.prev = head.next = &head;
+}
+
+ageList::ageList(const ageList &) {
+	head.prev = head.next = &head;
+}
+
+void ageList::touch(ageLink *l) {
+	l->unlink();
+
+	l->prev = head.prev;
+	l->next = &head;
+	head.prev->next = l;
+	head.prev = l;
 }
 
 Stats::Stats() {
@@ -1105,102 +1813,233 @@ Stats::Stats() {
 	timestamp = lastupdate = 0;
 	avgdelay = avgjitter = avgloss = avgdup = avgooo = 0;
 	rttl = 0;
+	pvalid = false;
+}
+
+bool Stats::is_valid(uint64_t now) const {
+	return valid && (now - lastupdate) <= timeFact(timeOutI);
 }
 
-void Stats::check_validity(uint64_t now) {
-	if ((now - lastupdate) > timeFact(timeOutI))
-		valid = false;
+Histogram::Histogram() {
+	clear();
 }
 
-typedef std::set<address> SourceSet;
-typedef std::map<address, SourceSet> SourceMap;
-typedef std::map<address, SourceMap> GroupMap;
-static GroupMap groupMap;
+void Histogram::clear() {
+	count = max = 0;
+	memset(buckets, 0, sizeof(buckets));
+}
 
-static void CountSSMJoin(const address &group, const address &source) {
-	address source_addr;
-	char tmp[64], tmp2[64], tmp3[64];
-	
-	source_addr.set_family(source.family());
-	source_addr.copy_address(source);
-	source_addr.set_port(0);
-	GroupMap::iterator g = groupMap.find(group);
-	if (g == groupMap.end()) {
-		if (verbose) 
-			info("Registering SSM group %s", group.to_string(tmp, sizeof(tmp)));
-		g = groupMap.insert(std::make_pair(group, SourceMap())).first;
-	}
-	SourceMap::iterator s = g->second.find(source_addr);
-	if (s == g->second.end()) {
-		if (verbose)
-			info("Joining (%s, %s)", source_addr.to_string(tmp, sizeof(tmp)),
-			     group.to_string(tmp2, sizeof(tmp2)));
-		if (SSMJoin(ssmMcastSock, group, source_addr) < 0) {
-			if (verbose)
-				info("Join failed, reason: %s", strerror(errno));
-			return;
-		} else {
-			s = g->second.insert(std::make_pair(source_addr, SourceSet())).first;
+static inline int msb32(uint32_t v) {
+#ifdef __GNUC__
+	return 31 - __builtin_clz(v);
+#else
+	int r = 0;
+	while (v >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+/* index of the last bucket hist_index() can return, the one of values just
+ * below 2^HIST_MAXBITS, must be within Histogram::buckets */
+typedef char hist_index_check[(((HIST_MAXBITS - HIST_SUBBITS) << HIST_SUBBITS)
+	+ (1 << HIST_SUBBITS) - 1) < HIST_BUCKETS ? 1 : -1];
+
+static inline uint32_t hist_index(uint32_t v) {
+	if (v < (1 << HIST_SUBBITS))
+		return v;
+
+	/* values of 2^HIST_MAXBITS and above all count in the last bucket */
+	int m = msb32(v);
+	if (m >= HIST_MAXBITS)
+		return HIST_BUCKETS - 1;
+
+	int shift = m - HIST_SUBBITS;
+	return ((shift + 1) << HIST_SUBBITS) + ((v >> shift) & ((1 << HIST_SUBBITS) - 1));
+}
+
+/* middle of the range of values counted in bucket `i' */
+static inline uint32_t hist_value(uint32_t i) {
+	if (i < (1 << HIST_SUBBITS))
+		return i;
+
+	int shift = (i >> HIST_SUBBITS) - 1;
+	uint32_t low = ((1 << HIST_SUBBITS) + (i & ((1 << HIST_SUBBITS) - 1))) << shift;
+	return low + ((1 << shift) >> 1);
+}
+
+void Histogram::add(uint32_t v) {
+	if (count == HIST_DECAY) {
+		count = 0;
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			buckets[i] >>= 1;
+			count += buckets[i];
 		}
-	} 
-	SourceSet::iterator ss = s->second.find(source);
-	if (ss == s->second.end()) {
-		if (verbose)
-			info("Adding beacon %s to (%s, %s)", source.to_string(tmp, sizeof(tmp)),
-			     source_addr.to_string(tmp2, sizeof(tmp2)),
-			     group.to_string(tmp3, sizeof(tmp3)));
-		s->second.insert(source);
-	}
-}
-
-static void CountSSMLeave(const address &group, const address &source) {
-	address source_addr;
-	char tmp[64], tmp2[64];
-
-	GroupMap::iterator g = groupMap.find(group);
-	assert(g != groupMap.end());
-	source_addr.set_family(source.family());
-	source_addr.copy_address(source);
-	source_addr.set_port(0);
-	SourceMap::iterator s = g->second.find(source_addr);
-	assert(s != g->second.end());
-	SourceSet::iterator ss = s->second.find(source);
-	if (ss == s->second.end()) {
-		return;
 	}
-	if (verbose)
-		info("Removing beacon %s from (%s, %s)", source.to_string(tmp, sizeof(tmp)),
-		     source_addr.to_string(tmp2, sizeof(tmp2)),
-		     group.to_string(tmp2, sizeof(tmp2)));
-	s->second.erase(ss);
-	if (s->second.empty()) {
-		if (verbose)
-			info("No more beacons for (%s, %s), leaving group",
-			     source_addr.to_string(tmp, sizeof(tmp)),
-			     group.to_string(tmp2, sizeof(tmp2)));
-		SSMLeave(ssmMcastSock,group, source_addr);
-		g->second.erase(s);
+
+	buckets[hist_index(v)]++;
+	count++;
+
+	if (v > max)
+		max = v;
+}
+
+/* fills `out' with P50, P90, P99 and PMAX */
+void Histogram::percentiles(float *out) const {
+	static const float fractions[PMAX] = { .5, .9, .99 };
+
+	uint32_t acc = 0;
+	int p = 0, i = 0;
+
+	for (; i < HIST_BUCKETS && p < PMAX; i++) {
+		acc += buckets[i];
+		while (p < PMAX && acc >= ceil(fractions[p] * count))
+			out[p++] = hist_value(i);
 	}
-	if (g->second.empty()) {
-		if (verbose)
-			info("No more sources, unregistering group %s, ", group.to_string(tmp, sizeof(tmp)));
-		groupMap.erase(g);
+
+	for (; p < PMAX; p++)
+		out[p] = max;
+
+	out[PMAX] = max;
+}
+
+beaconExternalStats::beaconExternalStats()
+	: owner(0), key(0), subject(NO_ID), lastupdate(0), age(0), identified(false) {
+	name = intern_string("", 0);
+	contact = intern_string("", 0);
+}
+
+beaconExternalStats::beaconExternalStats(const beaconExternalStats &o)
+	: ageLink(o), owner(o.owner), key(o.key), subject(o.subject), sibling(o.sibling),
+	  lastupdate(o.lastupdate), age(o.age), ASM(o.ASM), SSM(o.SSM),
+	  identified(o.identified) {
+	name = intern_string(o.name->data(), o.name->size());
+	contact = intern_string(o.contact->data(), o.contact->size());
+}
+
+beaconExternalStats::~beaconExternalStats() {
+	release_string(name);
+	release_string(contact);
+}
+
+/* names and contacts reported for a source are repeated in the reports of
+ * every other beacon, so we keep a single copy of each, with the number of
+ * entries using it. Names come from the network, the table only holds
+ * those still in use. */
+typedef std::map<std::string, uint32_t> StringTable;
+static StringTable stringTable;
+
+const std::string *intern_string(const char *str, int len) {
+	/* reuse the key's storage so lookups of known strings don't allocate */
+	static string key;
+	key.assign(str, len);
+
+	StringTable::iterator i = stringTable.find(key);
+	if (i == stringTable.end())
+		i = stringTable.insert(make_pair(key, 0)).first;
+
+	i->second++;
+
+	return &i->first;
+}
+
+void release_string(const std::string *str) {
+	StringTable::iterator i = stringTable.find(*str);
+	if (i != stringTable.end() && --i->second == 0)
+		stringTable.erase(i);
+}
+
+uint32_t maxSources = 2048, maxExternalSources = 2048;
+
+static uint64_t sourcesEvicted = 0, sourcesRefused = 0;
+static uint64_t externalEvicted = 0, externalRefused = 0;
+
+/* entries looked at, oldest first, when choosing one to evict */
+#define EVICT_SCAN	8
+
+/* Removes one of the least recently active sources, preferring those
+ * we don't receive from and those that never told us their name.
+ * Sources active right now, like the one whose report is being parsed,
+ * are never evicted. */
+static bool evict_source(uint64_t now) {
+	beaconSource *victim = 0;
+	int best = 0;
+
+	ageLink *l = sourceAge.first();
+	for (int n = 0; n < EVICT_SCAN && l != &sourceAge.head; n++, l = l->next) {
+		beaconSource *src = static_cast<beaconSource *>(l);
+		if (src->lastevent >= now)
+			break;
+
+		int rank = (src->identified ? 1 : 0) + (src->rxlocal(now) ? 2 : 0);
+		if (victim == 0 || rank < best) {
+			victim = src;
+			best = rank;
+		}
+	}
+
+	if (victim == 0)
+		return false;
+
+	if (verbose) {
+		char tmp[64];
+		info("Source table is full, evicting %s",
+		     victim->addr.to_string(tmp, sizeof(tmp)));
 	}
+
+	address addr = victim->addr;
+	removeSource(addr, false);
+
+	sourcesEvicted++;
+
+	return true;
 }
 
-beaconExternalStats::beaconExternalStats() : identified(false) {}
+static bool evict_external(sessionSource &owner, uint64_t now) {
+	beaconExternalStats *victim = 0;
 
-beaconSource &getSource(const address &baddr, const char *name, uint64_t now, uint64_t recvdts, bool rx_local) {
-	Sources::iterator i = sources.find(baddr);
-	if (i != sources.end()) {
-		i->second.lastevent = now;
+	ageLink *l = owner.externalOrder.first();
+	for (int n = 0; n < EVICT_SCAN && l != &owner.externalOrder.head; n++, l = l->next) {
+		beaconExternalStats *ext = static_cast<siblingLink *>(l)->entry;
+		if (ext->lastupdate >= now)
+			break;
+
+		if (victim == 0 || (victim->identified && !ext->identified))
+			victim = ext;
+	}
+
+	if (victim == 0)
+		return false;
+
+	owner.session->pairs.clear(victim);
+	owner.externalSources.erase(owner.externalSources.find(*victim->key));
+
+	externalEvicted++;
+
+	return true;
+}
+
+beaconSource *getSource(const address &baddr, const char *name, uint64_t now, uint64_t recvdts, bool rx_local) {
+	beaconSource *known = find_source(baddr);
+	if (known) {
+		known->lastevent = now;
 		if (rx_local)
-			i->second.lastlocalevent = now;
-		return i->second;
+			known->lastlocalevent = now;
+		sourceAge.touch(known);
+		return known;
+	}
+
+	if (maxSources && sources.size() >= maxSources && !evict_source(now)) {
+		sourcesRefused++;
+		return 0;
 	}
 
 	beaconSource &src = sources[baddr];
 
+	src.addr = baddr;
+	src.id = allocate_source_id();
+	index_source(&src);
+
 	if (verbose) {
 		char tmp[64];
 
@@ -1211,17 +2050,82 @@ beaconSource &getSource(const address &baddr, const char *name, uint64_t now, ui
 	}
 
 	if (name)
-		src.setName(name);
+		src.setName(name, strlen(name));
 
 	src.creation = now;
 	src.lastevent = now;
 	if (rx_local)
 		src.lastlocalevent = now;
+	sourceAge.touch(&src);
+
+	return &src;
+}
+
+sessionSource *getSessionSource(beaconSession &session, const address &baddr, const char *name,
+				uint64_t now, uint64_t recvdts, bool rx_local) {
+	beaconSource *src = getSource(baddr, name, now, recvdts, rx_local);
+	if (src == 0)
+		return 0;
+
+	sessionSource *view = src->views[session.index];
+
+	if (view == 0) {
+		view = &session.sources[baddr];
+
+		view->source = src;
+		view->session = &session;
+		view->creation = now;
+		src->views[session.index] = view;
+
+		if (verbose && sessions.size() > 1) {
+			char tmp[64];
+			info("Adding source %s to session %s", baddr.to_string(tmp, sizeof(tmp)),
+			     session_label(session).c_str());
+		}
+
+		if (session.ssm_enabled())
+			CountSSMJoin(session.ssmProbeAddr, session.ifindex, baddr);
+	}
 
-	if (IsSSMEnabled())
-		CountSSMJoin(ssmProbeAddr, baddr);
+	view->lastevent = now;
+	if (rx_local)
+		view->lastlocalevent = now;
+	session.sourceAge.touch(view);
+
+	return view;
+}
+
+/* Forgets what the session knows of the source */
+static void drop_view(beaconSession &session, beaconSource &src) {
+	if (session.ssm_enabled())
+		CountSSMLeave(session.ssmProbeAddr, session.ifindex, src.addr);
+
+	session.pairs.clear_source(src.id);
+	session.sources.erase(src.addr);
+
+	src.views[session.index] = 0;
+}
+
+void removeSessionSource(beaconSession &session, const address &baddr, bool timeout) {
+	beaconSource *src = find_source(baddr);
+	if (src == 0 || src->views[session.index] == 0)
+		return;
+
+	drop_view(session, *src);
+
+	for (uint32_t k = 0; k < MAX_SESSIONS; k++) {
+		if (src->views[k]) {
+			if (verbose) {
+				char tmp[64];
+				info("Removing source %s from session %s%s",
+				     baddr.to_string(tmp, sizeof(tmp)), session_label(session).c_str(),
+				     (timeout ? " by Timeout" : ""));
+			}
+			return;
+		}
+	}
 
-	return src;
+	removeSource(baddr, timeout);
 }
 
 void removeSource(const address &baddr, bool timeout) {
@@ -1240,52 +2144,87 @@ void removeSource(const address &baddr, bool timeout) {
 			}
 		}
 
-		if (IsSSMEnabled())
-			CountSSMLeave(ssmProbeAddr, baddr);
+		/* entries of other sources about it are in every session */
+		for (Sessions::const_iterator j = sessions.begin(); j != sessions.end(); ++j) {
+			if (i->second.views[(*j)->index])
+				drop_view(**j, i->second);
+			else
+				(*j)->pairs.clear_source(i->second.id);
+		}
+
+		release_source_id(i->second.id);
+		unindex_source(&i->second);
 
 		sources.erase(i);
 	}
 }
 
 beaconSource::beaconSource()
-	: identified(false) {
+	: id(NO_ID), identified(false) {
 	sttl = 0;
 	lastlocalevent = 0;
 	Flags = 0;
+	memset(views, 0, sizeof(views));
+}
+
+sessionSource::sessionSource()
+	: source(0), session(0), creation(0), lastevent(0), lastlocalevent(0) {
 }
 
-void beaconSource::setName(const string &n) {
-	name = n;
+beaconSession::beaconSession(uint32_t idx)
+	: index(idx), ssmSock(0), sendCount(0), ssmSendCount(0) {
+	seq = rand();
+	ssmSeq = rand();
+}
+
+void beaconSource::setName(const char *n, int len) {
+	if (name.compare(0, string::npos, n, len) != 0)
+		name.assign(n, len);
 	identified = true;
 }
 
-beaconExternalStats &beaconSource::getExternal(const address &baddr, uint64_t now, uint64_t ts) {
-	ExternalSources::iterator k = externalSources.find(baddr);
-	if (k == externalSources.end()) {
-		externalSources.insert(make_pair(baddr, beaconExternalStats()));
-		k = externalSources.find(baddr);
+beaconExternalStats *sessionSource::getExternal(const address &baddr, uint32_t subject, uint64_t now, uint64_t ts) {
+	/* entries about known sources are found in our row of the matrix */
+	beaconExternalStats *stats = subject != NO_ID ? session->pairs.cell(source->id, subject) : 0;
 
-		k->second.age = 0;
+	if (stats == 0) {
+		ExternalSources::iterator k = externalSources.find(baddr);
+		if (k == externalSources.end()) {
+			if (maxExternalSources && externalSources.size() >= maxExternalSources
+				&& !evict_external(*this, now)) {
+				externalRefused++;
+				return 0;
+			}
 
-		if (verbose) {
-			char tmp[64];
-			info("Adding external source (%s) %s", name.c_str(), baddr.to_string(tmp, sizeof(tmp)));
+			k = externalSources.insert(make_pair(baddr, beaconExternalStats())).first;
+
+			k->second.owner = this;
+			k->second.key = &k->first;
+			k->second.sibling.entry = &k->second;
+			k->second.age = 0;
+
+			if (verbose) {
+				char tmp[64];
+				info("Adding external source (%s) %s", source->name.c_str(), baddr.to_string(tmp, sizeof(tmp)));
+			}
 		}
-	}
 
-	beaconExternalStats &stats = k->second;
+		stats = &k->second;
+	}
 
-	stats.lastupdate = now;
+	stats->lastupdate = now;
+	externalAge.touch(stats);
+	externalOrder.touch(&stats->sibling);
 
 	return stats;
 }
 
 template<typename T> T udiff(T a, T b) { if (a > b) return a - b; return b - a; }
 
-void beaconSource::update(uint8_t ttl, uint32_t seqnum, uint64_t timestamp, uint64_t now, uint64_t recvts, bool ssm) {
+void sessionSource::update(uint8_t ttl, uint32_t seqnum, uint64_t timestamp, uint64_t now, uint64_t recvts, bool ssm) {
 	if (verbose > 2)
 		info("beacon(%s%s) update %u, %llu, %llu",
-			name.c_str(), (ssm ? "/SSM" : ""), seqnum, timestamp, now);
+			source->name.c_str(), (ssm ? "/SSM" : ""), seqnum, timestamp, now);
 
 	beaconMcastState *st = ssm ? &SSM : &ASM;
 
@@ -1296,6 +2235,93 @@ bool beaconSource::rxlocal(uint64_t now) const {
 	return (now - lastlocalevent) < timeFact(timeOutI);
 }
 
+bool sessionSource::rxlocal(uint64_t now) const {
+	return (now - lastlocalevent) < timeFact(timeOutI);
+}
+
+/* window lengths in seconds, shortest first */
+uint32_t statsWindows[STATS_WINDOWS] = { 10, 60, 300 };
+
+slidingStats::slidingStats() {
+	clear(0);
+}
+
+void slidingStats::clear(uint64_t sec) {
+	second = sec;
+	head = 0;
+
+	memset(ring, 0, sizeof(ring));
+	memset(windows, 0, sizeof(windows));
+}
+
+/* moves the ring forward to `now', expiring the seconds that leave
+ * each window */
+void slidingStats::advance(uint64_t now) {
+	uint64_t sec = now / 1000;
+
+	if (sec <= second)
+		return;
+
+	if ((sec - second) >= STATS_HISTORY) {
+		clear(sec);
+		return;
+	}
+
+	for (; second < sec; second++) {
+		head = (head + 1) % STATS_HISTORY;
+
+		for (int k = 0; k < STATS_WINDOWS; k++) {
+			const statsBucket &old =
+				ring[(head + STATS_HISTORY - statsWindows[k]) % STATS_HISTORY];
+			statsWindow &w = windows[k];
+
+			w.expected -= old.expected;
+			w.received -= old.received;
+			w.lost -= old.lost;
+			w.dup -= old.dup;
+			w.ooo -= old.ooo;
+			w.delay -= old.delay;
+		}
+
+		memset(&ring[head], 0, sizeof(statsBucket));
+	}
+}
+
+void slidingStats::add(int expected, int received, int lost, int dup, int ooo, float delay) {
+	statsBucket &b = ring[head];
+
+	b.expected += expected;
+	b.received += received;
+	b.lost += lost;
+	b.dup += dup;
+	b.ooo += ooo;
+	b.delay += delay;
+
+	for (int k = 0; k < STATS_WINDOWS; k++) {
+		statsWindow &w = windows[k];
+
+		w.expected += expected;
+		w.received += received;
+		w.lost += lost;
+		w.dup += dup;
+		w.ooo += ooo;
+		w.delay += delay;
+	}
+}
+
+void statsWindow::fill(Stats &s) const {
+	if (expected <= 0 || received <= 0) {
+		s.avgdelay = s.avgloss = s.avgdup = s.avgooo = 0;
+		return;
+	}
+
+	s.avgdelay = delay / received;
+	/* late probes may be credited after their loss left the window */
+	s.avgloss = lost > 0 ? lost / (float)expected : 0;
+	s.avgooo = ooo / (float)expected;
+	s.avgdup = dup / (float)expected;
+}
+
 beaconMcastState::beaconMcastState() {
 	refresh(0, 0);
 }
@@ -1305,16 +2331,68 @@ void beaconMcastState::refresh(uint32_t seq, uint64_t now) {
 	s.timestamp = 0;
 	s.lastupdate = now;
 
-	packetcount = packetcountreal = 0;
-	pointer = 0;
+	packetcount = 0;
+	memset(seqwindow, 0, sizeof(seqwindow));
 
-	lastdelay = lastjitter = lastloss = lastdup = lastooo = 0;
+	lastjitter = 0;
+	windows.clear(now / 1000);
 	s.avgdelay = s.avgjitter = s.avgloss = s.avgdup = s.avgooo = 0;
 	s.valid = false;
+
+	delayhist.clear();
+	ipdvhist.clear();
+	s.pvalid = false;
+
+	resync = false;
+}
+
+void beaconMcastState::restore(const Stats &saved, uint64_t now) {
+	refresh(0, now);
+
+	s = saved;
+	s.timestamp = 0;
+
+	resync = true;
 }
 
 int64_t abs64(int64_t foo) { return foo < 0 ? -foo : foo; }
 
+#if SEQ_WINDOW != 64 && SEQ_WINDOW != 128 && SEQ_WINDOW != 256
+#error "SEQ_WINDOW must be one of 64, 128 or 256"
+#endif
+
+static const int seqWindowWords = SEQ_WINDOW / 32;
+
+/* ages every entry in the window by `n' sequence numbers */
+static void seqwindow_shift(uint32_t *w, uint32_t n) {
+	if (n >= SEQ_WINDOW) {
+		memset(w, 0, seqWindowWords * sizeof(uint32_t));
+		return;
+	}
+
+	int ws = n / 32, bs = n % 32;
+
+	for (int i = seqWindowWords - 1; i >= 0; i--) {
+		uint32_t v = 0;
+
+		if (i >= ws) {
+			v = w[i - ws] << bs;
+			if (bs && i > ws)
+				v |= w[i - ws - 1] >> (32 - bs);
+		}
+
+		w[i] = v;
+	}
+}
+
+/* marks `age' as received, returns whether it already was */
+static inline bool seqwindow_test_and_set(uint32_t *w, uint32_t age) {
+	uint32_t bit = 1 << (age % 32);
+	bool was = (w[age / 32] & bit) != 0;
+	w[age / 32] |= bit;
+	return was;
+}
+
 // logic adapted from java beacon
 
 void beaconMcastState::update(uint8_t ttl, uint32_t seqnum, uint64_t timestamp, uint64_t tsnow, uint64_t _now) {
@@ -1330,140 +2408,160 @@ void beaconMcastState::update(uint8_t ttl, uint32_t seqnum, uint64_t timestamp,
 	int64_t diff = now - timestamp;
 	int64_t absdiff = abs64(diff);
 
-	if (udiff(seqnum, lastseq) > PACKETS_VERY_OLD) {
+	bool resynced = resync;
+
+	if (resync) {
+		/* probes sent while we were down weren't lost */
+		lastseq = seqnum - 1;
+		resync = false;
+	} else if (udiff(seqnum, lastseq) > PACKETS_VERY_OLD) {
 		refresh(seqnum - 1, tsnow);
 	}
 
-	if (seqnum < lastseq && (lastseq - seqnum) >= packetcount)
+	/* distance to the highest sequence number seen, modulo 2^32 */
+	int32_t advance = seqnum - lastseq;
+
+	if (advance <= 0 && (uint32_t)-advance >= SEQ_WINDOW)
 		return;
 
 	s.timestamp = timestamp;
 	s.lastupdate = tsnow;
 
-	bool dup = false;
+	s.rttl = ttl;
 
-	uint32_t expectseq = lastseq + 1;
+	bool dup = false;
 
-	if (seqnum < expectseq) {
-		for (uint32_t i = 0; i < pointer; i++) {
-			if (cacheseqnum[i] == seqnum) {
-				dup = true;
-				break;
-			}
-		}
+	if (advance > 0) {
+		seqwindow_shift(seqwindow, advance);
+		seqwindow_test_and_set(seqwindow, 0);
+	} else {
+		dup = seqwindow_test_and_set(seqwindow, -advance);
 	}
 
-	s.rttl = ttl;
+	windows.advance(tsnow);
 
 	if (dup) {
-		lastdup ++;
+		windows.add(0, 0, 0, 1, 0, 0);
 	} else {
-		packetcountreal++;
-
-		cacheseqnum[pointer++] = seqnum;
-
-		lastdelay += diff;
+		packetcount++;
 
 		int newjitter = absdiff - lastjitter;
-		lastjitter = absdiff;
 		if (newjitter < 0)
 			newjitter = -newjitter;
-		s.avgjitter = 15/16. * s.avgjitter + 1/16. * newjitter;
+		/* the restored jitter has no probe before this one to compare to */
+		if (!resynced)
+			s.avgjitter = 15/16. * s.avgjitter + 1/16. * newjitter;
 
-		if (expectseq == seqnum) {
-			packetcount ++;
-		} else if (seqnum > expectseq) {
-			packetcount += seqnum - lastseq;
+		delayhist.add(absdiff > 0xffffffff ? 0xffffffff : absdiff);
+		/* the first probe after a refresh has no previous one */
+		if (delayhist.count > 1)
+			ipdvhist.add(newjitter);
 
-			lastloss += seqnum - lastseq - 1;
-		} else {
-			lastloss --;
-			lastooo ++;
-		}
+		lastjitter = absdiff;
 
-		if (expectseq <= seqnum) {
+		if (advance > 0) {
+			windows.add(advance, 1, advance - 1, 0, 0, diff);
 			lastseq = seqnum;
+		} else {
+			/* was accounted as lost when the gap was seen */
+			windows.add(0, 1, -1, 0, 1, diff);
 		}
 	}
 
-	if (packetcount >= PACKETS_PERIOD) {
-		s.avgdelay = lastdelay / (float)packetcountreal;
-		s.avgloss = lastloss / (float)packetcount;
-		s.avgooo = lastooo / (float)packetcount;
-		s.avgdup = lastdup / (float)packetcount;
+	const statsWindow &w = windows.windows[STATS_REPORT_WINDOW];
 
+	if (w.expected >= STATS_MIN_PROBES && w.received > 0) {
+		w.fill(s);
 		s.valid = true;
 
-		lastdelay = 0;
-		lastloss = 0;
-		lastooo = 0;
-		lastdup = 0;
-		packetcount = 0;
-		packetcountreal = 0;
-		pointer = 0;
+		if (packetcount >= PACKETS_PERIOD || !s.pvalid) {
+			delayhist.percentiles(s.pdelay);
+			ipdvhist.percentiles(s.pjitter);
+			s.pvalid = true;
+
+			packetcount = 0;
+		}
 	}
 }
 
-static int send_nprobe(const address &addr, uint32_t &seq) {
+static int send_buffer(const beaconSession &session, const address &to, int len) {
+	int sock = find_local(to.family(), session.ifindex)->sock;
+
+	if (uringActive)
+		return UringSendTo(sock, buffer, len, to);
+
+	return sendto(sock, buffer, len, 0, to.saddr(), to.addrlen());
+}
+
+static int send_nprobe(const beaconSession &session, const address &addr, uint32_t &seq) {
 	int len;
 
 	len = build_probe(buffer, bufferLen, seq, get_time_of_day());
 	seq++;
 
-	len = sendto(mcastSock, buffer, len, 0, addr.saddr(), addr.addrlen());
+	len = send_buffer(session, addr, len);
 	if (len > 0)
 		bytesSent += len;
 	return len;
 }
 
-int send_probe() {
-	static uint32_t seq = rand();
-
-	return send_nprobe(probeAddr, seq);
+int send_probe(beaconSession &session) {
+	return send_nprobe(session, session.probeAddr, session.seq);
 }
 
-int send_ssm_probe() {
-	static uint32_t seq = rand();
-
-	return send_nprobe(ssmProbeAddr, seq);
+int send_ssm_probe(beaconSession &session) {
+	return send_nprobe(session, session.ssmProbeAddr, session.ssmSeq);
 }
 
-int send_report(int type) {
+int send_report(beaconSession &session, int type) {
 	int len;
 
-	len = build_report(buffer, bufferLen, type == SSM_REPORT ? STATS_REPORT : type, true);
+	len = build_report(session, buffer, bufferLen, type == SSM_REPORT ? STATS_REPORT : type, true);
 	if (len < 0)
 		return len;
 
 	int res;
 
 	if (type == SSM_REPORT) {
-		if ((res = sendto(mcastSock, buffer, len, 0, ssmProbeAddr.saddr(), ssmProbeAddr.addrlen())) < 0)
+		if ((res = send_buffer(session, session.ssmProbeAddr, len)) < 0)
 			d_log(LOG_DEBUG, "Failed to send SSM report: %s", strerror(errno));
 		else
 			bytesSent += res;
 	} else {
-		for (vector<address>::const_iterator i = redist.begin();
-				i != redist.end(); ++i) {
-			char tmp[64];
+		char tmp[64];
 
-			if (verbose)
-				d_log(LOG_DEBUG, "Sending Report to %s",
-					i->to_string(tmp, sizeof(tmp)));
+		if (verbose)
+			d_log(LOG_DEBUG, "Sending Report to %s",
+				session.probeAddr.to_string(tmp, sizeof(tmp)));
 
-			if ((res = sendto(mcastSock, buffer, len, 0, i->saddr(),
-					i->addrlen())) < 0)
-				d_log(LOG_DEBUG, "Failed to send report to %s: %s",
-					i->to_string(tmp, sizeof(tmp)), strerror(errno));
-			else
-				bytesSent += res;
-		}
+		if ((res = send_buffer(session, session.probeAddr, len)) < 0)
+			d_log(LOG_DEBUG, "Failed to send report to %s: %s",
+				session.probeAddr.to_string(tmp, sizeof(tmp)), strerror(errno));
+		else
+			bytesSent += res;
 	}
 
 	return 0;
 }
 
-void dumpStats(FILE *fp, const char *tag, const Stats &s, uint64_t now, int sttl, bool diff) {
+static void dumpWindows(FILE *fp, const slidingStats &win) {
+	for (int k = 0; k < STATS_WINDOWS; k++) {
+		const statsWindow &w = win.windows[k];
+		Stats s;
+
+		w.fill(s);
+
+		fprintf(fp, "\t\t\t\t\t<window secs=\"%u\" probes=\"%i\"", statsWindows[k], w.received);
+		fprintf(fp, " loss=\"%.1f\"", s.avgloss * 100);
+		fprintf(fp, " delay=\"%.3f\"", fabs(s.avgdelay));
+		fprintf(fp, " ooo=\"%.3f\"", s.avgooo * 100);
+		fprintf(fp, " dup=\"%.3f\"", s.avgdup * 100);
+		fprintf(fp, " />\n");
+	}
+}
+
+void dumpStats(FILE *fp, const char *tag, const Stats &s, uint64_t now, int sttl, bool diff,
+		const slidingStats *win = 0) {
 	fprintf(fp, "\t\t\t\t<%s", tag);
 	if (!diff)
 		fprintf(fp, " ttl=\"%i\"", s.rttl);
@@ -1478,42 +2576,120 @@ void dumpStats(FILE *fp, const char *tag, const Stats &s, uint64_t now, int sttl
 	fprintf(fp, " jitter=\"%.3f\"", s.avgjitter);
 	fprintf(fp, " ooo=\"%.3f\"", s.avgooo * 100);
 	fprintf(fp, " dup=\"%.3f\"", s.avgdup * 100);
-	fprintf(fp, " />\n");
+	if (s.pvalid) {
+		static const char *pnames[PCOUNT] = { "p50", "p90", "p99", "max" };
+
+		for (int k = 0; k < PCOUNT; k++)
+			fprintf(fp, " delay_%s=\"%.0f\"", pnames[k], s.pdelay[k]);
+		for (int k = 0; k < PCOUNT; k++)
+			fprintf(fp, " jitter_%s=\"%.0f\"", pnames[k], s.pjitter[k]);
+	}
+	if (win) {
+		fprintf(fp, ">\n");
+		dumpWindows(fp, *win);
+		fprintf(fp, "\t\t\t\t</%s>\n", tag);
+	} else {
+		fprintf(fp, " />\n");
+	}
 }
 
 static void doLaunchSomething();
 
-void do_dump() {
-	string tmpf = dumpFile;
-	tmpf += ".working";
+/* Whether the entry's stats are fresh, as of the last sweep of the pair
+ * matrix. Entries about sources we don't keep have no cell there. */
+static bool external_valid(const beaconExternalStats &ext, int ch, uint64_t now) {
+	if (ext.subject == NO_ID)
+		return (ch == pairMatrix::ASM_CHANNEL ? ext.ASM : ext.SSM).is_valid(now);
 
-	FILE *fp = fopen(tmpf.c_str(), "w");
-	if (!fp)
-		return;
+	return ext.owner->session->pairs.is_alive(ext, ch);
+}
 
-	uint64_t now = get_timestamp();
-	uint64_t diff = now - lastDumpDumpBwTS;
-	lastDumpDumpBwTS = now;
+/* Stats of the whole process, in the first group */
+static void dump_process(FILE *fp, uint64_t now, uint32_t alivePairs) {
+	if (IsSSMEnabled()) {
+		ssmJoinStats st;
+		GetSSMJoinStats(st);
 
-	double rxRate = dumpBytesReceived * 8 / ((double)diff);
-	double txRate = dumpBytesSent * 8 / ((double)diff);
-	dumpBytesReceived = 0;
-	dumpBytesSent = 0;
+		fprintf(fp, "\t<ssmjoins pending=\"%u\" leaving=\"%u\" joins=\"%llu\""
+			" leaves=\"%llu\" failed=\"%llu\" />\n", st.pending, st.leaving,
+			(unsigned long long)st.joins, (unsigned long long)st.leaves,
+			(unsigned long long)st.failed);
+	}
 
-	fprintf(fp, "<beacons rxrate=\"%.2f\" txrate=\"%.2f\" versioninfo=\"%s\">\n", rxRate, txRate, versionInfo);
+	fprintf(fp, "\t<sourcetable count=\"%u\" max=\"%u\" evicted=\"%llu\" refused=\"%llu\""
+		" external_max=\"%u\" external_evicted=\"%llu\" external_refused=\"%llu\""
+		" pairs=\"%u\" />\n",
+		(uint32_t)sources.size(), maxSources, (unsigned long long)sourcesEvicted,
+		(unsigned long long)sourcesRefused, maxExternalSources,
+		(unsigned long long)externalEvicted, (unsigned long long)externalRefused,
+		alivePairs);
+
+	size_t reserved, used;
+	pool_usage(reserved, used);
+
+	fprintf(fp, "\t<memory pool_reserved=\"%lu\" pool_used=\"%lu\" />\n",
+		(unsigned long)reserved, (unsigned long)used);
+
+	uint64_t dropped = 0;
+	for (McastSocks::const_iterator i = mcastSocks.begin(); i != mcastSocks.end(); ++i)
+		dropped += SocketDrops(i->first);
 
-	fprintf(fp, "<group addr=\"%s\"", sessionName);
+	fprintf(fp, "\t<sockets count=\"%u\" kernel_dropped=\"%llu\" />\n",
+		(uint32_t)mcastSocks.size(), (unsigned long long)dropped);
 
+	if (captureSock >= 0) {
+		uint64_t captured, captureDrops;
+		CaptureStats(captured, captureDrops);
+
+		fprintf(fp, "\t<capture interface=\"%s\" packets=\"%llu\" dropped=\"%llu\" />\n",
+			captureInterface.c_str(), (unsigned long long)captured,
+			(unsigned long long)captureDrops);
+	}
+
+	if (xdpSock >= 0) {
+		uint64_t received, xdpDrops;
+		XdpStats(received, xdpDrops);
+
+		fprintf(fp, "\t<xdp interface=\"%s\" packets=\"%llu\" dropped=\"%llu\" />\n",
+			xdpInterface.c_str(), (unsigned long long)received,
+			(unsigned long long)xdpDrops);
+	}
+
+	float late[PCOUNT];
+	probeLateness.percentiles(late);
+
+	fprintf(fp, "\t<scheduler probes=\"%llu\" late_p50=\"%.0f\" late_p90=\"%.0f\""
+		" late_p99=\"%.0f\" late_max=\"%.0f\" />\n",
+		(unsigned long long)probesScheduled, late[P50], late[P90], late[P99], late[PMAX]);
+}
+
+static void dump_session(FILE *fp, beaconSession &session, uint64_t now,
+			 uint32_t sessionPairs, uint32_t alivePairs, bool first) {
 	char tmp[64];
 
-	if (IsSSMEnabled())
-		fprintf(fp, " ssmgroup=\"%s\"", ssmProbeAddr.to_string(tmp, sizeof(tmp)));
+	fprintf(fp, "<group addr=\"%s\"", session.name.c_str());
+
+	if (!session.ifname.empty())
+		fprintf(fp, " interface=\"%s\"", session.ifname.c_str());
+
+	if (!session.ssmProbeAddr.is_unspecified())
+		fprintf(fp, " ssmgroup=\"%s\"", session.ssmProbeAddr.to_string(tmp, sizeof(tmp)));
 
 	fprintf(fp, " int=\"%.2f\">\n", beacInt);
 
-	if (!probeAddr.is_unspecified()) {
-		fprintf(fp, "\t<beacon name=\"%s\" addr=\"%s\"", beaconName.c_str(),
-				beaconUnicastAddr.to_string(tmp, sizeof(tmp)));
+	if (first)
+		dump_process(fp, now, alivePairs);
+
+	if (sessions.size() > 1)
+		fprintf(fp, "\t<session sources=\"%u\" pairs=\"%u\" />\n",
+			(uint32_t)session.sources.size(), sessionPairs);
+
+	/* what we receive, also when only capturing */
+	if (!session.probeAddr.is_unspecified() || captureSock >= 0) {
+		fprintf(fp, "\t<beacon name=\"%s\"", beaconName.c_str());
+		const localEndpoint *local = find_local(session.probeAddr.family(), session.ifindex);
+		if (local)
+			fprintf(fp, " addr=\"%s\"", local->addr.to_string(tmp, sizeof(tmp)));
 		if (!adminContact.empty())
 			fprintf(fp, " contact=\"%s\"", adminContact.c_str());
 		if (!twoLetterCC.empty())
@@ -1534,25 +2710,32 @@ void do_dump() {
 
 		fprintf(fp, "\t\t<sources>\n");
 
-		for (Sources::const_iterator i = sources.begin(); i != sources.end(); i++) {
+		for (SessionSources::iterator i = session.sources.begin(); i != session.sources.end(); i++) {
+			const beaconSource &src = *i->second.source;
+
 			fprintf(fp, "\t\t\t<source addr=\"%s\"", i->first.to_string(tmp, sizeof(tmp)));
-			if (i->second.identified) {
-				fprintf(fp, " name=\"%s\"", i->second.name.c_str());
-				if (!i->second.adminContact.empty())
-					fprintf(fp, " contact=\"%s\"", i->second.adminContact.c_str());
+			if (src.identified) {
+				fprintf(fp, " name=\"%s\"", src.name.c_str());
+				if (!src.adminContact.empty())
+					fprintf(fp, " contact=\"%s\"", src.adminContact.c_str());
 			}
 
-			if (!i->second.CC.empty())
-				fprintf(fp, " country=\"%s\"", i->second.CC.c_str());
+			if (!src.CC.empty())
+				fprintf(fp, " country=\"%s\"", src.CC.c_str());
 
 			fprintf(fp, " age=\"%lu\"", (now - i->second.creation) / 1000);
 			fprintf(fp, " lastupdate=\"%lu\">\n", (now - i->second.lastevent) / 1000);
 
-			if (i->second.ASM.s.valid)
-				dumpStats(fp, "asm", i->second.ASM.s, now, i->second.sttl, true);
+			i->second.ASM.windows.advance(now);
+			i->second.SSM.windows.advance(now);
+
+			if (i->second.ASM.s.is_valid(now))
+				dumpStats(fp, "asm", i->second.ASM.s, now, src.sttl, true,
+					&i->second.ASM.windows);
 
-			if (i->second.SSM.s.valid)
-				dumpStats(fp, "ssm", i->second.SSM.s, now, i->second.sttl, true);
+			if (i->second.SSM.s.is_valid(now))
+				dumpStats(fp, "ssm", i->second.SSM.s, now, src.sttl, true,
+					&i->second.SSM.windows);
 
 			fprintf(fp, "\t\t\t</source>\n");
 		}
@@ -1562,12 +2745,14 @@ void do_dump() {
 		fprintf(fp, "\n");
 	}
 
-	for (Sources::const_iterator i = sources.begin(); i != sources.end(); i++) {
+	for (SessionSources::const_iterator i = session.sources.begin(); i != session.sources.end(); i++) {
+		const beaconSource &src = *i->second.source;
+
 		fprintf(fp, "\t<beacon");
-		if (i->second.identified) {
-			fprintf(fp, " name=\"%s\"", i->second.name.c_str());
-			if (!i->second.adminContact.empty())
-				fprintf(fp, " contact=\"%s\"", i->second.adminContact.c_str());
+		if (src.identified) {
+			fprintf(fp, " name=\"%s\"", src.name.c_str());
+			if (!src.adminContact.empty())
+				fprintf(fp, " contact=\"%s\"", src.adminContact.c_str());
 		}
 		fprintf(fp, " addr=\"%s\"", i->first.to_string(tmp, sizeof(tmp)));
 		fprintf(fp, " age=\"%lu\"", (now - i->second.creation) / 1000);
@@ -1575,13 +2760,13 @@ void do_dump() {
 		fprintf(fp, " lastupdate=\"%lu\">\n", (now - i->second.lastevent) / 1000);
 
 		for (uint32_t k = 0; k < KnownFlags; k++) {
-			if (i->second.Flags & (1 << k)) {
+			if (src.Flags & (1 << k)) {
 				fprintf(fp, "\t\t<flag name=\"%s\" value=\"true\" />\n", Flags[k]);
 			}
 		}
 
-		for (WebSites::const_iterator j = i->second.webSites.begin();
-						j != i->second.webSites.end(); j++) {
+		for (WebSites::const_iterator j = src.webSites.begin();
+						j != src.webSites.end(); j++) {
 			const char *typnam = j->first == T_WEBSITE_GENERIC ?
 				"generic" : (j->first == T_WEBSITE_LG ? "lg" : "matrix");
 			fprintf(fp, "\t\t<website type=\"%s\" url=\"%s\" />\n",
@@ -1590,19 +2775,19 @@ void do_dump() {
 
 		fprintf(fp, "\t\t<sources>\n");
 
-		for (beaconSource::ExternalSources::const_iterator j = i->second.externalSources.begin();
+		for (sessionSource::ExternalSources::const_iterator j = i->second.externalSources.begin();
 				j != i->second.externalSources.end(); j++) {
 			fprintf(fp, "\t\t\t<source");
 			if (j->second.identified) {
-				fprintf(fp, " name=\"%s\"", j->second.name.c_str());
-				fprintf(fp, " contact=\"%s\"", j->second.contact.c_str());
+				fprintf(fp, " name=\"%s\"", j->second.name->c_str());
+				fprintf(fp, " contact=\"%s\"", j->second.contact->c_str());
 			}
 			fprintf(fp, " addr=\"%s\"", j->first.to_string(tmp, sizeof(tmp)));
 			fprintf(fp, " age=\"%u\">\n", j->second.age);
-			if (j->second.ASM.valid)
-				dumpStats(fp, "asm", j->second.ASM, now, i->second.sttl, false);
-			if (j->second.SSM.valid)
-				dumpStats(fp, "ssm", j->second.SSM, now, i->second.sttl, false);
+			if (external_valid(j->second, pairMatrix::ASM_CHANNEL, now))
+				dumpStats(fp, "asm", j->second.ASM, now, src.sttl, false);
+			if (external_valid(j->second, pairMatrix::SSM_CHANNEL, now))
+				dumpStats(fp, "ssm", j->second.SSM, now, src.sttl, false);
 			fprintf(fp, "\t\t\t</source>\n");
 		}
 
@@ -1610,7 +2795,39 @@ void do_dump() {
 		fprintf(fp, "\t</beacon>\n");
 	}
 
-	fprintf(fp, "</group>\n</beacons>\n");
+	fprintf(fp, "</group>\n");
+}
+
+void do_dump() {
+	static const string tmpf = dumpFile + ".working";
+
+	FILE *fp = fopen(tmpf.c_str(), "w");
+	if (!fp)
+		return;
+
+	uint64_t now = get_timestamp();
+	uint64_t diff = now - lastDumpDumpBwTS;
+	lastDumpDumpBwTS = now;
+
+	double rxRate = dumpBytesReceived * 8 / ((double)diff);
+	double txRate = dumpBytesSent * 8 / ((double)diff);
+	dumpBytesReceived = 0;
+	dumpBytesSent = 0;
+
+	fprintf(fp, "<beacons rxrate=\"%.2f\" txrate=\"%.2f\" versioninfo=\"%s\">\n", rxRate, txRate, versionInfo);
+
+	vector<uint32_t> sessionPairs;
+	uint32_t alivePairs = 0;
+
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		sessionPairs.push_back((*i)->pairs.sweep(now, timeFact(timeOutI)));
+		alivePairs += sessionPairs.back();
+	}
+
+	for (uint32_t k = 0; k < sessions.size(); k++)
+		dump_session(fp, *sessions[k], now, sessionPairs[k], alivePairs, k == 0);
+
+	fprintf(fp, "</beacons>\n");
 
 	fclose(fp);
 
@@ -1640,6 +2857,9 @@ static void scaleBeaconInterval(double rate) {
 	/* `rate' is the incoming data rate in kbit/s gathered from the
 	 * last 10 seconds. */
 
+	if (fixedBeaconInterval)
+		return;
+
 	/* smooth our values */
 	if (rate < 4.)
 		rate = 4.;
@@ -1680,10 +2900,302 @@ void dumpBigBwStats(int) {
 					bigBytesSent, bigBytesSent * 8 / (1000. * diff));
 }
 
-void sendLeaveReport(int) {
-	send_report(LEAVE_REPORT);
+void leaveSignal(int) {
+	leaving = 1;
+}
+
+/* Called by the event loops once asked to leave. Sending, writing the
+ * state and exit() aren't safe in a signal handler, which may have
+ * stopped any of them halfway. */
+static void sendLeaveReport() {
+	/* queued sends would never be submitted */
+	uringActive = false;
+
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		if (!(*i)->probeAddr.is_unspecified())
+			send_report(**i, LEAVE_REPORT);
+	}
+
+	if (!stateFile.empty())
+		SaveState(stateFile.c_str());
+
 	if (daemonize && pidfile)
 		unlink(pidfile);
+	if (controlSock >= 0)
+		unlink(controlPath.c_str());
 	exit(0);
 }
 
+/* Runtime reconfiguration, for the control socket */
+
+static bool has_event(uint32_t type) {
+	for (tq_def::const_iterator i = timers.begin(); i != timers.end(); ++i) {
+		if (i->type == type)
+			return true;
+	}
+
+	return false;
+}
+
+/* removes the pending events of `type', or of the session if given */
+static void remove_events(uint32_t type, const beaconSession *s) {
+	for (tq_def::iterator i = timers.begin(); i != timers.end();) {
+		if (s ? i->session == s : i->type == type)
+			timers.erase(i++);
+		else
+			++i;
+	}
+}
+
+static void close_session_sockets(const beaconSession *s) {
+	for (McastSocks::iterator i = mcastSocks.begin(); i != mcastSocks.end();) {
+		if (session_of(i->first) == s) {
+			close(i->first);
+			set_session(i->first, 0);
+			mcastSocks.erase(i++);
+		} else {
+			++i;
+		}
+	}
+}
+
+void GetIntervals(double &probe, bool &fixed, double &report, uint32_t &dump) {
+	probe = beacInt;
+	fixed = fixedBeaconInterval;
+	report = reportInterval ? reportInterval / 1000. : reportI * beacInt;
+	dump = dumpFile.empty() ? 0 : dumpInterval;
+}
+
+bool SetProbeInterval(double secs, string &error) {
+	if (secs == 0) {
+		/* follows the traffic again from the next bandwidth sample */
+		fixedBeaconInterval = false;
+		return true;
+	}
+
+	if (secs < 1 || secs > 60) {
+		error = "Probe interval must be between 1 and 60 seconds.";
+		return false;
+	}
+
+	if (reportInterval && reportInterval > timeOutI * secs * 1000 / 2) {
+		error = "Report interval would be too long, change it first.";
+		return false;
+	}
+
+	beacInt = secs;
+	fixedBeaconInterval = true;
+
+	return true;
+}
+
+bool SetReportInterval(double secs, string &error) {
+	/* others time us out after timeOutI intervals without reports */
+	if (secs != 0 && (secs < 1 || secs > timeOutI * beacInt / 2)) {
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "%.2f", timeOutI * beacInt / 2);
+		error = string("Report interval must be between 1 and ") + tmp + " seconds.";
+		return false;
+	}
+
+	reportInterval = (uint32_t)(secs * 1000);
+
+	return true;
+}
+
+bool SetDumpInterval(uint32_t secs, string &error) {
+	if (dumpFile.empty()) {
+		error = "Not dumping, check -d.";
+		return false;
+	}
+
+	if (secs < 5) {
+		error = "Dump interval must be at least 5 seconds.";
+		return false;
+	}
+
+	dumpInterval = secs;
+
+	remove_events(DUMP_EVENT, 0);
+	insert_event(DUMP_EVENT, dumpInterval * 1000);
+
+	return true;
+}
+
+bool ForceDump(string &error) {
+	if (dumpFile.empty()) {
+		error = "Not dumping, check -d.";
+		return false;
+	}
+
+	do_dump();
+
+	return true;
+}
+
+bool AddBootstrap(const address &addr, string &error) {
+	for (vector<address>::const_iterator i = ssmBootstrap.begin(); i != ssmBootstrap.end(); ++i) {
+		if (i->is_equal(addr)) {
+			error = "Already bootstrapping from " + addr.to_string() + ".";
+			return false;
+		}
+	}
+
+	ssmBootstrap.push_back(addr);
+
+	uint64_t now = get_timestamp();
+	for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+		if ((*i)->ssm_enabled() && (*i)->probeAddr.family() == addr.family())
+			getSessionSource(**i, addr, 0, now, 0, false);
+	}
+
+	return true;
+}
+
+/* Sources we heard from stay, until they time out */
+bool RemoveBootstrap(const address &addr, string &error) {
+	vector<address>::iterator i = ssmBootstrap.begin();
+	while (i != ssmBootstrap.end() && !i->is_equal(addr))
+		++i;
+
+	if (i == ssmBootstrap.end()) {
+		error = "Not bootstrapping from " + addr.to_string() + ".";
+		return false;
+	}
+
+	ssmBootstrap.erase(i);
+
+	beaconSource *src = find_source(addr);
+	if (src && !src->identified) {
+		for (Sessions::const_iterator j = sessions.begin(); j != sessions.end(); ++j)
+			removeSessionSource(**j, addr, false);
+	}
+
+	return true;
+}
+
+bool AddSession(const char *group, const char *ssmAddr, bool useSSM,
+		const char *ifname, string &error) {
+	if (captureSock >= 0) {
+		error = "Groups can't be added when capturing.";
+		return false;
+	}
+
+	uint32_t index = 0;
+	for (; index < MAX_SESSIONS; index++) {
+		Sessions::const_iterator i = sessions.begin();
+		while (i != sessions.end() && (*i)->index != index)
+			++i;
+		if (i == sessions.end())
+			break;
+	}
+
+	if (index == MAX_SESSIONS) {
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "At most %u sessions are supported.", MAX_SESSIONS);
+		error = tmp;
+		return false;
+	}
+
+	sessionConfig conf;
+	conf.addr = group;
+	conf.useSSM = conf.listenForSSM = useSSM;
+	if (ssmAddr)
+		conf.ssmAddr = ssmAddr;
+
+	if (ifname) {
+		conf.ifindex = if_nametoindex(ifname);
+		if (conf.ifindex <= 0) {
+			error = "Invalid interface name.";
+			return false;
+		}
+		conf.ifname = ifname;
+	}
+
+	beaconSession *s = setup_session(conf, index, error);
+	if (s == 0)
+		return false;
+
+	if (open_session(s, conf.listenForSSM) < 0) {
+		error = string("Failed to open the group sockets: ") + strerror(errno);
+
+		remove_events(0, s);
+		if (s->ssm_enabled())
+			SSMJoinRemove(s->ssmProbeAddr, s->ifindex);
+		close_session_sockets(s);
+		delete s;
+
+		return false;
+	}
+
+	sessions.push_back(s);
+
+	if (s->ssm_enabled()) {
+		flags |= SSM_CAPABLE;
+
+		if (!has_event(SSM_JOIN_EVENT))
+			insert_event(SSM_JOIN_EVENT, 1000);
+
+		uint64_t now = get_timestamp();
+		for (vector<address>::const_iterator i = ssmBootstrap.begin();
+				i != ssmBootstrap.end(); ++i) {
+			if (s->probeAddr.family() == i->family())
+				getSessionSource(*s, *i, 0, now, 0, false);
+		}
+	}
+
+	info("Added beacon group %s", session_label(*s).c_str());
+
+	send_report(*s, WEBSITE_REPORT_EVENT);
+
+	return true;
+}
+
+bool RemoveSession(const address &group, int ifindex, string &error) {
+	Sessions::iterator i = sessions.begin();
+	while (i != sessions.end() && !(same_group((*i)->probeAddr, group)
+					&& (*i)->ifindex == ifindex))
+		++i;
+
+	if (i == sessions.end()) {
+		error = "No such beacon group.";
+		return false;
+	}
+
+	/* receives stay posted on the sockets we would close */
+	if (uringActive) {
+		error = "Groups can't be removed with -Bu.";
+		return false;
+	}
+
+	if (sessions.size() == 1) {
+		error = "Can't remove the last beacon group.";
+		return false;
+	}
+
+	beaconSession *s = *i;
+
+	send_report(*s, LEAVE_REPORT);
+
+	remove_events(0, s);
+
+	vector<address> addrs;
+	for (SessionSources::const_iterator j = s->sources.begin(); j != s->sources.end(); ++j)
+		addrs.push_back(j->first);
+
+	for (vector<address>::const_iterator j = addrs.begin(); j != addrs.end(); ++j)
+		removeSessionSource(*s, *j, false);
+
+	if (s->ssm_enabled())
+		SSMJoinRemove(s->ssmProbeAddr, s->ifindex);
+
+	close_session_sockets(s);
+
+	info("Removed beacon group %s", session_label(*s).c_str());
+
+	sessions.erase(i);
+	delete s;
+
+	return true;
+}
+
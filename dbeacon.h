@@ -12,10 +12,23 @@
 #include <stdint.h>
 #endif
 
+#include <sys/select.h>
+
 #include <string>
 #include <map>
+#include <vector>
 
 #include "address.h"
+#include "pool.h"
+
+// Percentiles kept for delay and jitter distributions
+enum {
+	P50,
+	P90,
+	P99,
+	PMAX,
+	PCOUNT
+};
 
 struct Stats {
 	Stats();
@@ -25,11 +38,128 @@ struct Stats {
 	bool valid;
 	uint8_t rttl;
 
-	void check_validity(uint64_t);
+	/* tail of the one-way delay and IPDV distributions */
+	float pdelay[PCOUNT], pjitter[PCOUNT];
+	bool pvalid;
+
+	bool is_valid(uint64_t now) const;
+};
+
+/* Log-linear histogram of millisecond values with 2^HIST_SUBBITS buckets
+ * per power of two (12.5% resolution). Recording is constant time and
+ * never allocates; counts are halved every HIST_DECAY samples so the
+ * distribution follows recent behaviour. */
+struct Histogram {
+	Histogram();
+
+#define HIST_SUBBITS	3
+#define HIST_MAXBITS	20
+#define HIST_BUCKETS	((HIST_MAXBITS - HIST_SUBBITS + 1) << HIST_SUBBITS)
+#define HIST_DECAY	4096
+
+	uint32_t count, max;
+	uint16_t buckets[HIST_BUCKETS];
+
+	void clear();
+	void add(uint32_t);
+	void percentiles(float *) const;
+};
+
+/* Probes accounted during one second */
+struct statsBucket {
+	int16_t expected, received, lost, dup, ooo;
+	float delay;
 };
 
-struct beaconExternalStats {
+/* Sums of the buckets in one window */
+struct statsWindow {
+	int32_t expected, received, lost, dup, ooo;
+	double delay;
+
+	void fill(Stats &) const;
+};
+
+/* Loss, delay, duplicate and reordering counters over the last
+ * statsWindows[] seconds, kept in a ring of per second buckets. Adding a
+ * probe and expiring a second are constant time operations. */
+struct slidingStats {
+	slidingStats();
+
+#define STATS_HISTORY		300
+#define STATS_WINDOWS		3
+/* window whose values are kept in Stats and announced in reports */
+#define STATS_REPORT_WINDOW	1
+/* probes a window must expect before its values are meaningful */
+#define STATS_MIN_PROBES	10
+
+	uint64_t second;
+	uint32_t head;
+
+	statsBucket ring[STATS_HISTORY];
+	statsWindow windows[STATS_WINDOWS];
+
+	void clear(uint64_t second);
+	void advance(uint64_t now);
+	void add(int expected, int received, int lost, int dup, int ooo, float delay);
+};
+
+extern uint32_t statsWindows[STATS_WINDOWS];
+
+/* Intrusive list link. Sources and external sources are kept in lists
+ * ordered by last activity, so aging them only looks at the entries that
+ * actually expired. */
+struct ageLink {
+	ageLink() : prev(0), next(0) {}
+	/* copies and assignments never carry list membership */
+	ageLink(const ageLink &) : prev(0), next(0) {}
+	ageLink &operator=(const ageLink &) { return *this; }
+	~ageLink() { unlink(); }
+
+	ageLink *prev, *next;
+
+	void unlink();
+};
+
+struct ageList {
+	ageList();
+	/* a copy starts empty, entries stay in the original */
+	ageList(const ageList &);
+	ageList &operator=(const ageList &) { return *this; }
+
+	ageLink head;
+
+	bool empty() const { return head.next == &head; }
+	ageLink *first() const { return head.next; }
+
+	/* moves `l' to the tail, i.e. makes it the most recent entry */
+	void touch(ageLink *l);
+};
+
+struct beaconSource;
+struct sessionSource;
+struct beaconSession;
+struct beaconExternalStats;
+
+/* Link of an external entry in the list of its owner's entries */
+struct siblingLink : ageLink {
+	siblingLink() : entry(0) {}
+
+	beaconExternalStats *entry;
+};
+
+struct beaconExternalStats : ageLink {
 	beaconExternalStats();
+	/* copies hold their own references to the interned strings */
+	beaconExternalStats(const beaconExternalStats &);
+	~beaconExternalStats();
+
+	/* the beacon reporting this entry and its key there */
+	sessionSource *owner;
+	const address *key;
+	/* id of the source this entry is about, NO_ID if unknown */
+	uint32_t subject;
+
+	siblingLink sibling;
 
 	uint64_t lastupdate;
 	uint32_t age;
@@ -37,7 +167,11 @@ struct beaconExternalStats {
 	Stats ASM, SSM;
 
 	bool identified;
-	std::string name, contact;
+	/* shared with every other entry carrying the same value */
+	const std::string *name, *contact;
+
+private:
+	beaconExternalStats &operator=(const beaconExternalStats &);
 };
 
 struct beaconMcastState {
@@ -45,28 +179,54 @@ struct beaconMcastState {
 
 	uint32_t lastseq;
 
-	uint32_t packetcount, packetcountreal;
-	uint32_t pointer;
+	/* probes received since percentiles were last taken */
+	uint32_t packetcount;
 
-	int lastdelay, lastjitter, lastloss, lastdup, lastooo;
+	int lastjitter;
 
 	Stats s;
 
+	Histogram delayhist, ipdvhist;
+
+	slidingStats windows;
+
 #define PACKETS_PERIOD		40
 #define PACKETS_VERY_OLD	150
 
-	uint32_t cacheseqnum[PACKETS_PERIOD+1];
+/* Number of sequence numbers remembered behind the highest one seen, used
+ * to classify duplicates and reordered probes. Either 64, 128 or 256. */
+#ifndef SEQ_WINDOW
+#define SEQ_WINDOW		128
+#endif
+
+	/* bit N is set if probe `lastseq - N' was received */
+	uint32_t seqwindow[SEQ_WINDOW / 32];
+
+	/* restored from a snapshot, the next probe starts the sequence */
+	bool resync;
 
 	void refresh(uint32_t, uint64_t);
+	/* takes `saved' as the current stats, keeping its lastupdate */
+	void restore(const Stats &saved, uint64_t now);
 	void update(uint8_t, uint32_t, uint64_t, uint64_t, uint64_t);
 };
 
-typedef std::map<int, std::string> WebSites;
+typedef std::map<int, std::string, std::less<int>,
+	poolAllocator<std::pair<const int, std::string> > > WebSites;
 
-struct beaconSource {
+/* Beacon sessions sharing this process, each with its own groups */
+#ifndef MAX_SESSIONS
+#define MAX_SESSIONS	8
+#endif
+
+/* A beacon, whatever sessions we see it in. Its stats live in the
+ * sessionSource of each of those sessions. */
+struct beaconSource : ageLink {
 	beaconSource();
 
 	address addr;
+	/* dense id, the row and column of this source in the pair matrices */
+	uint32_t id;
 
 	uint64_t creation;
 
@@ -75,12 +235,10 @@ struct beaconSource {
 	uint64_t lastevent;
 	uint64_t lastlocalevent;
 
-	beaconMcastState ASM, SSM;
-
-	void setName(const std::string &);
-	void update(uint8_t, uint32_t, uint64_t, uint64_t, uint64_t, bool);
+	/* what each session knows of this source, by session index */
+	sessionSource *views[MAX_SESSIONS];
 
-	beaconExternalStats &getExternal(const address &, uint64_t now, uint64_t ts);
+	void setName(const char *, int);
 
 	bool rxlocal(uint64_t now) const;
 
@@ -90,29 +248,208 @@ struct beaconSource {
 
 	uint32_t Flags;
 
-	typedef std::map<address, beaconExternalStats> ExternalSources;
-	ExternalSources externalSources;
-
 	WebSites webSites;
 
 	bool identified;
 };
 
-typedef std::map<address, beaconSource> Sources;
+typedef std::map<address, beaconSource, std::less<address>,
+	poolAllocator<std::pair<const address, beaconSource> > > Sources;
+
+/* A source as seen in one session: the probes we receive from it there
+ * and what it reports there about the others */
+struct sessionSource : ageLink {
+	sessionSource();
+
+	beaconSource *source;
+	beaconSession *session;
+
+	uint64_t creation;
+	uint64_t lastevent;
+	uint64_t lastlocalevent;
+
+	beaconMcastState ASM, SSM;
 
-beaconSource &getSource(const address &, const char *name, uint64_t now, uint64_t recvts, bool rxlocal);
+	void update(uint8_t, uint32_t, uint64_t, uint64_t, uint64_t, bool);
+
+	/* NULL if the table is full and no entry may be evicted. Entries
+	 * about a known `subject' are found through the pair matrix. */
+	beaconExternalStats *getExternal(const address &, uint32_t subject, uint64_t now, uint64_t ts);
+
+	bool rxlocal(uint64_t now) const;
+
+	/* external entries by last update, must outlive them */
+	ageList externalOrder;
+
+	typedef std::map<address, beaconExternalStats, std::less<address>,
+		poolAllocator<std::pair<const address, beaconExternalStats> > > ExternalSources;
+	ExternalSources externalSources;
+};
+
+typedef std::map<address, sessionSource, std::less<address>,
+	poolAllocator<std::pair<const address, sessionSource> > > SessionSources;
+
+/* NULL if the table is full and no source may be evicted */
+beaconSource *getSource(const address &, const char *name, uint64_t now, uint64_t recvts, bool rxlocal);
+/* removes the source from every session */
 void removeSource(const address &, bool);
 
+/* Same as getSource(), also adding the source to the session */
+sessionSource *getSessionSource(beaconSession &, const address &, const char *name,
+				uint64_t now, uint64_t recvts, bool rxlocal);
+/* the source is removed from the table once it is in no session */
+void removeSessionSource(beaconSession &, const address &, bool);
+
+/* Table limits, 0 for none */
+extern uint32_t maxSources, maxExternalSources;
+
+/* Interned strings are counted, every intern_string() is paired with a
+ * release_string() and a string goes away with its last reference */
+const std::string *intern_string(const char *, int);
+void release_string(const std::string *);
+
+/* Source ids. The local beacon is always LOCAL_ID. */
+#define LOCAL_ID	0
+#define NO_ID		0xffffffff
+
+uint32_t allocate_source_id();
+void release_source_id(uint32_t);
+
+/* Sources by address in a hash table, so looking up a known source costs
+ * the same however many sources there are */
+void index_source(beaconSource *);
+void unindex_source(const beaconSource *);
+beaconSource *find_source(const address &);
+
+/* Hot values of the stats every source reports about the others, one
+ * array per value indexed by row * stride + column, where the row is the
+ * reporting source's id and the column the id of the source reported on.
+ * Finding out which pairs are alive walks contiguous memory in fixed size
+ * blocks the compiler vectorizes, instead of every source's map. */
+struct pairMatrix {
+	pairMatrix();
+
+/* cells are swept this many at a time, stride is a multiple of it */
+#define PAIR_BLOCK	16
+
+	enum {
+		ASM_CHANNEL,
+		SSM_CHANNEL,
+		CHANNELS
+	};
+
+	uint32_t stride;
+
+	/* low 32 bits of the last update, reported values, whether the cell
+	 * has stats and whether they were still fresh in the last sweep */
+	std::vector<uint32_t> updated[CHANNELS];
+	std::vector<float> delay[CHANNELS], jitter[CHANNELS], loss[CHANNELS];
+	std::vector<uint8_t> present[CHANNELS], alive[CHANNELS];
+
+	/* external entry owning each cell */
+	std::vector<beaconExternalStats *> entry;
+
+	void reserve(uint32_t id);
+	/* grows ahead of the source ids in use, so that reports seldom
+	 * have to wait for the matrix to be laid out again */
+	void prepare();
+
+	/* the external entry of a cell, if any */
+	beaconExternalStats *cell(uint32_t row, uint32_t col) const;
+
+	/* copies the stats `ext' received at `now' into the matrix */
+	void update(uint32_t row, beaconExternalStats *ext, uint32_t col, uint64_t now);
+
+	struct rowUpdate {
+		beaconExternalStats *ext;
+		uint32_t col;
+	};
+
+	/* writes the cells of a whole report in one go */
+	void update_row(uint32_t row, const rowUpdate *, uint32_t count, uint64_t now);
+	void clear(const beaconExternalStats *);
+	/* clears the row and column of a source going away */
+	void clear_source(uint32_t id);
+
+	/* returns the number of alive cells */
+	uint32_t sweep(uint64_t now, uint32_t timeout);
+	bool is_alive(const beaconExternalStats &, int channel) const;
+};
+
+/* One beacon group, with its optional SSM channel. Sessions share the
+ * sockets, timers, source table and SSM joins, everything else is kept
+ * per session. */
+struct beaconSession {
+	beaconSession(uint32_t index);
+
+	uint32_t index;
+
+	/* unspecified when only listening */
+	address probeAddr;
+	/* unspecified without SSM */
+	address ssmProbeAddr;
+	std::string name;
+
+	/* interface the groups are joined and probes sent on, 0 for any */
+	int ifindex;
+	std::string ifname;
+
+	/* socket receiving the SSM channel, 0 if SSM is disabled */
+	int ssmSock;
+
+	uint32_t seq, ssmSeq;
+	/* probes sent in the current burst */
+	int sendCount, ssmSendCount;
+
+	SessionSources sources;
+	/* sources by last activity in this session */
+	ageList sourceAge;
+
+	pairMatrix pairs;
+
+	bool ssm_enabled() const { return ssmSock != 0; }
+};
+
+typedef std::vector<beaconSession *> Sessions;
+extern Sessions sessions;
+
+void CountSSMJoin(const address &group, int ifindex, const address &source);
+void CountSSMLeave(const address &group, int ifindex, const address &source);
+void ApplySSMJoins();
+
+struct ssmJoinStats {
+	/* sources waiting to be joined and joined sources waiting to be left */
+	uint32_t pending, leaving;
+	uint64_t joins, leaves, failed;
+};
+
+void GetSSMJoinStats(ssmJoinStats &);
+
+extern uint32_t ssmJoinRate, ssmLeaveDelay;
+
+/* Monotonic and wall clock in milliseconds, as of the last update_clock() */
 uint64_t get_timestamp();
 uint64_t get_time_of_day();
 
-int SetupSSMPing();
+void update_clock();
+
+/* Replaces the system clocks, e.g. by a virtual clock. NULL restores them. */
+typedef void (*ClockSource)(uint64_t &timestamp, uint64_t &timeofday);
+void set_clock_source(ClockSource);
+
+int SetupSSMPing(int family);
+
+/* Warm restart snapshot, see state.cpp. Stats older than `maxAge' ms are
+ * not restored. */
+bool SaveState(const char *path);
+void LoadState(const char *path, uint64_t maxAge);
 
 extern const char * const defaultPort;
 extern const int defaultTTL;
 
 extern int forceFamily;
-extern int mcastInterface;
+/* SO_BUSY_POLL time in usecs, 0 to sleep in select() */
+extern int busyPoll;
 
 struct beaconExternalStats;
 
@@ -121,17 +458,26 @@ extern uint32_t flags;
 extern std::string beaconName, adminContact, twoLetterCC;
 extern Sources sources;
 extern WebSites webSites;
-extern address beaconUnicastAddr;
+
+/* Our unicast address of the family, unspecified if no session uses it */
+const address &LocalAddress(int family);
+/* all of them, one per interface with a session */
+void LocalAddresses(int family, std::vector<address> &);
+bool IsLocalAddress(const address &);
+/* If a session on an interface other than `ifindex' uses `group' */
+bool GroupOnOtherInterface(const address &group, int ifindex);
 
 extern int verbose;
 
 void info(const char *format, ...);
 void fatal(const char *format, ...);
 
-address get_local_address_for(const address &);
+address get_local_address_for(const address &, int ifindex);
 
 void d_log(int level, const char *format, ...);
 int dbeacon_daemonize(const char *pidfile);
+bool SetCPUAffinity(int cpu);
+bool SetRealtimePriority(int priority);
 
 struct Message {
 	address from, to;
@@ -142,6 +488,30 @@ struct Message {
 };
 
 typedef void (*SocketHandler)(int socket, const Message &);
-void ListenTo(int sock, SocketHandler);
+/* `sibling', if given, is a socket of the session the new one serves */
+void ListenTo(int sock, SocketHandler, int sibling = -1);
+
+void SSMJoinSetup(int sock, const address &bindaddr, int ifindex, SocketHandler);
+void SSMJoinRemove(const address &bindaddr, int ifindex);
+
+/* Control socket, see control.cpp. ControlRead() serves the clients ready
+ * in `readset', or polls all of them if NULL. */
+int ControlSetup(const char *path);
+void ControlFds(fd_set &readset, int &maxfd);
+void ControlRead(const fd_set *readset);
+
+/* Runtime reconfiguration. Intervals are in seconds, 0 restores the
+ * default. Failures are explained in `error'. */
+void GetIntervals(double &probe, bool &fixed, double &report, uint32_t &dump);
+bool SetProbeInterval(double, std::string &error);
+bool SetReportInterval(double, std::string &error);
+bool SetDumpInterval(uint32_t, std::string &error);
+bool ForceDump(std::string &error);
+bool AddBootstrap(const address &, std::string &error);
+bool RemoveBootstrap(const address &, std::string &error);
+/* `ssm' and `ifname' may be NULL */
+bool AddSession(const char *group, const char *ssm, bool useSSM, const char *ifname,
+		std::string &error);
+bool RemoveSession(const address &group, int ifindex, std::string &error);
 
 #endif
@@ -19,10 +19,22 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/times.h>
+#include <time.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <net/if.h>
 #include <cstdlib>
 
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#endif
+
+#include <vector>
+
+#include "protocol.h"
+
 #ifndef CMSG_LEN
 #define CMSG_LEN(size)	(sizeof(struct cmsghdr) + (size))
 #endif
@@ -37,10 +49,10 @@
 #define TTLType         int
 #endif
 
-int _McastListenNewAPI(int sock, const address &grpaddr);
-int _McastListenOldAPI(int sock, const address &grpaddr);
+int _McastListenNewAPI(int sock, const address &grpaddr, int ifindex);
+int _McastListenOldAPI(int sock, const address &grpaddr, int ifindex);
 
-static int (*_McastListen)(int, const address &) = _McastListenOldAPI;
+static int (*_McastListen)(int, const address &, int) = _McastListenOldAPI;
 
 #ifndef MCAST_JOIN_GROUP
 #define MCAST_JOIN_GROUP 42
@@ -55,6 +67,10 @@ static int (*_McastListen)(int, const address &) = _McastListenOldAPI;
 #define MCAST_FILTER	48
 #endif
 
+#ifndef MCAST_INCLUDE
+#define MCAST_INCLUDE	1
+#endif
+
 // Since some GLIBCs include this definitions, and others don't (i'm not even
 // talking about BSDs) we instead define them localy to avoid definition colisions
 
@@ -108,44 +124,51 @@ void MulticastStartup() {
 	}
 }
 
-int _McastListenNewAPI(int sock, const address &grpaddr) {
+int _McastListenNewAPI(int sock, const address &grpaddr, int ifindex) {
 	_loc_group_req grp;
 
 	memset(&grp, 0, sizeof(grp));
-	grp.gr_interface = mcastInterface;
+	grp.gr_interface = ifindex;
 
 	set_address(grp.gr_group, grpaddr);
 
 	return setsockopt(sock, grpaddr.optlevel(), MCAST_JOIN_GROUP, &grp, sizeof(grp));
 }
 
-int _McastListenOldAPI(int sock, const address &grpaddr) {
+int _McastListenOldAPI(int sock, const address &grpaddr, int ifindex) {
 	if (grpaddr.family() == AF_INET6) {
 		ipv6_mreq mreq;
-		mreq.ipv6mr_interface = mcastInterface;
+		mreq.ipv6mr_interface = ifindex;
 		mreq.ipv6mr_multiaddr = grpaddr.v6()->sin6_addr;
 
 		return setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
 	} else {
+#if defined(__linux__) || defined(__FreeBSD__)
+		ip_mreqn mreq;
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_ifindex = ifindex;
+#else
 		ip_mreq mreq;
 		memset(&mreq, 0, sizeof(mreq));
 		// Specifying the interface doesn't work, there's ip_mreqn in linux..
 		// but what about other OSs? -hugo
+#endif
 		mreq.imr_multiaddr = grpaddr.v4()->sin_addr;
 
 		return setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
 	}
 }
 
-int MulticastListen(int sock, const address &grpaddr) {
-	return (*_McastListen)(sock, grpaddr);
+int MulticastListen(int sock, const address &grpaddr, int ifindex) {
+	return (*_McastListen)(sock, grpaddr, ifindex);
 }
 
-static int SSMJoinLeave(int sock, int type, const address &grpaddr, const address &srcaddr) {
+static int SSMJoinLeave(int sock, int type, const address &grpaddr, const address &srcaddr,
+			int ifindex) {
 	_loc_group_source_req req;
 	memset(&req, 0, sizeof(req));
 
-	req.gsr_interface = mcastInterface;
+	req.gsr_interface = ifindex;
 
 	set_address(req.gsr_group, grpaddr);
 	set_address(req.gsr_source, srcaddr);
@@ -153,15 +176,41 @@ static int SSMJoinLeave(int sock, int type, const address &grpaddr, const addres
 	return setsockopt(sock, srcaddr.optlevel(), type, &req, sizeof(req));
 }
 
-int SSMJoin(int sock, const address &grpaddr, const address &srcaddr) {
-	return SSMJoinLeave(sock, MCAST_JOIN_SOURCE_GROUP, grpaddr, srcaddr);
+int SSMJoin(int sock, const address &grpaddr, const address &srcaddr, int ifindex) {
+	return SSMJoinLeave(sock, MCAST_JOIN_SOURCE_GROUP, grpaddr, srcaddr, ifindex);
+}
+
+int SSMLeave(int sock, const address &grpaddr, const address &srcaddr, int ifindex) {
+	return SSMJoinLeave(sock, MCAST_LEAVE_SOURCE_GROUP, grpaddr, srcaddr, ifindex);
 }
 
-int SSMLeave(int sock, const address &grpaddr, const address &srcaddr) {
-	return SSMJoinLeave(sock, MCAST_LEAVE_SOURCE_GROUP, grpaddr, srcaddr);
+/* Replaces the group's source filter with an include list of `count' sources,
+ * an empty list leaves the group */
+int SSMSetFilter(int sock, const address &grpaddr, const address *srcs, int count, int ifindex) {
+	static std::vector<uint8_t> buf;
+
+	size_t len = sizeof(_loc_group_filter)
+		+ (count > 0 ? count - 1 : 0) * sizeof(sockaddr_storage);
+	if (buf.size() < len)
+		buf.resize(len);
+
+	memset(&buf[0], 0, len);
+
+	_loc_group_filter *flt = (_loc_group_filter *)&buf[0];
+
+	flt->gf_interface = ifindex;
+	flt->gf_fmode = MCAST_INCLUDE;
+	flt->gf_numsrc = count;
+
+	set_address(flt->gf_group, grpaddr);
+
+	for (int i = 0; i < count; i++)
+		set_address(flt->gf_slist[i], srcs[i]);
+
+	return setsockopt(sock, grpaddr.optlevel(), MCAST_FILTER, flt, len);
 }
 
-int SetupSocket(const address &addr, bool shouldbind, bool ssm) {
+int SetupSocket(const address &addr, bool shouldbind, bool ssm, int ifindex) {
 	int af_family = addr.family();
 	int level = addr.optlevel();
 
@@ -171,6 +220,14 @@ int SetupSocket(const address &addr, bool shouldbind, bool ssm) {
 		return -1;
 	}
 
+	/* the main loop watches it with select() */
+	if (sock >= FD_SETSIZE) {
+		close(sock);
+		errno = EMFILE;
+		perror("Failed to create multicast socket");
+		return -1;
+	}
+
 	int on = 1;
 
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) {
@@ -178,6 +235,43 @@ int SetupSocket(const address &addr, bool shouldbind, bool ssm) {
 		return -1;
 	}
 
+#ifdef IPV6_V6ONLY
+	/* IPv4 has sockets of its own, e.g. SSM Ping on the same port */
+	if (af_family == AF_INET6)
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+#endif
+
+	/* sockets of every interface are bound to the same group, unless
+	 * bound to their interface one would take the traffic of the others */
+	if (ifindex) {
+		bool bound = false;
+
+#ifdef SO_BINDTODEVICE
+		char ifname[IF_NAMESIZE];
+
+		bound = if_indextoname(ifindex, ifname)
+			&& setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname)) == 0;
+#else
+		errno = ENOPROTOOPT;
+#endif
+
+		if (!bound) {
+			int err = errno;
+
+			if (GroupOnOtherInterface(addr, ifindex)) {
+				d_log(LOG_ERR, "Failed to bind socket to interface %i, needed "
+					"with %s on other interfaces: %s", ifindex,
+					addr.to_string().c_str(), strerror(err));
+				close(sock);
+				errno = err;
+				return -1;
+			}
+
+			d_log(LOG_WARNING, "Failed to bind socket to interface %i, it may "
+				"receive from other interfaces: %s", ifindex, strerror(err));
+		}
+	}
+
 	if (shouldbind) {
 		if (bind(sock, addr.saddr(), addr.addrlen()) != 0) {
 			perror("Failed to bind multicast socket");
@@ -192,6 +286,23 @@ int SetupSocket(const address &addr, bool shouldbind, bool ssm) {
 	}
 #endif
 
+	if (busyPoll > 0) {
+		/* raising it over net.core.busy_read needs CAP_NET_ADMIN,
+		 * we spin on the socket ourselves anyway */
+#ifdef SO_BUSY_POLL
+		if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) != 0)
+			perror("setsockopt(SO_BUSY_POLL)");
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+		setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+#endif
+
+		if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != 0) {
+			perror("fcntl(O_NONBLOCK)");
+			return -1;
+		}
+	}
+
 	int type = level == IPPROTO_IPV6 ?
 #ifdef IPV6_RECVHOPLIMIT
 				IPV6_RECVHOPLIMIT
@@ -215,8 +326,17 @@ int SetupSocket(const address &addr, bool shouldbind, bool ssm) {
 		return -1;
 	}
 
+	/* only beacon traffic reaches group sockets */
+	if (addr.is_multicast()) {
+		std::vector<address> self;
+		LocalAddresses(addr.family(), self);
+
+		if (!AttachBeaconFilter(sock, self) && errno != ENOSYS)
+			perror("setsockopt(SO_ATTACH_FILTER)");
+	}
+
 	if (!ssm && addr.is_multicast()) {
-		if (MulticastListen(sock, addr) != 0) {
+		if (MulticastListen(sock, addr, ifindex) != 0) {
 			perror("Failed to join multicast group");
 			return -1;
 		}
@@ -241,44 +361,178 @@ bool SetHops(int sock, const address &addr, int ttl) {
 	return true;
 }
 
+bool SetMulticastInterface(int sock, const address &addr, int ifindex) {
+	if (addr.optlevel() == IPPROTO_IPV6) {
+		unsigned int index = ifindex;
+		return setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index)) == 0;
+	}
+
+#if defined(__linux__) || defined(__FreeBSD__)
+	ip_mreqn mreq;
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_ifindex = ifindex;
+
+	return setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) == 0;
+#else
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+bool SetMulticastLoop(int sock, const address &addr, bool on) {
+	if (addr.optlevel() == IPPROTO_IPV6) {
+		unsigned int loop = on;
+		return setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)) == 0;
+	} else {
+		uint8_t loop = on;
+		return setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == 0;
+	}
+}
+
+#if defined(__linux__) && defined(SO_ATTACH_FILTER)
+
+/* Filter programs see the packet from the UDP header on */
+#define UDP_PAYLOAD	8
+
+static void bpf_stmt(std::vector<sock_filter> &prog, uint16_t code, uint32_t k) {
+	sock_filter f = { code, 0, 0, k };
+	prog.push_back(f);
+}
+
+/* jumps to instruction `jt' or `jf' of the program, -1 is the next one */
+static void bpf_jump(std::vector<sock_filter> &prog, uint16_t code, uint32_t k, int jt, int jf) {
+	int next = prog.size() + 1;
+
+	sock_filter f = { code, (uint8_t)(jt < 0 ? 0 : jt - next),
+		(uint8_t)(jf < 0 ? 0 : jf - next), k };
+	prog.push_back(f);
+}
+
+/* 32 bit words of the address, 0 if there is none */
+static int address_words(const address &addr) {
+	if (addr.is_unspecified())
+		return 0;
+	return addr.family() == AF_INET6 ? 4 : 1;
+}
+
+/* Accepts probes and reports of our protocol version, except those sent
+ * from any of `self' */
+static void build_beacon_filter(std::vector<sock_filter> &prog, const std::vector<address> &self) {
+	int body = 0;
+
+	for (std::vector<address>::const_iterator i = self.begin(); i != self.end(); ++i) {
+		int words = address_words(*i);
+		if (words)
+			body += 2 + 2 * words;
+	}
+
+	const int accept = body + 13, drop = body + 14;
+
+	/* one block per address, going on to the next unless it matches */
+	for (std::vector<address>::const_iterator i = self.begin(); i != self.end(); ++i) {
+		int words = address_words(*i), offset;
+		uint32_t addr[4];
+
+		if (!words)
+			continue;
+
+		if (words == 4) {
+			/* source address of the IPv6 header */
+			offset = 8;
+			memcpy(addr, &i->v6()->sin6_addr, sizeof(addr));
+		} else {
+			offset = 12;
+			memcpy(addr, &i->v4()->sin_addr, sizeof(addr[0]));
+		}
+
+		const int next = prog.size() + 2 + 2 * words;
+
+		bpf_stmt(prog, BPF_LD | BPF_H | BPF_ABS, 0);
+		bpf_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, i->port(), -1, next);
+
+		for (int j = 0; j < words; j++) {
+			bpf_stmt(prog, BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + offset + 4 * j);
+			bpf_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, ntohl(addr[j]),
+				j == words - 1 ? drop : -1, next);
+		}
+	}
+
+	bpf_stmt(prog, BPF_LD | BPF_H | BPF_ABS, UDP_PAYLOAD);
+	bpf_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, 0xbeac, -1, drop);
+	bpf_stmt(prog, BPF_LD | BPF_B | BPF_ABS, UDP_PAYLOAD + 2);
+	bpf_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, PROTO_VER, -1, drop);
+
+	/* the length includes the UDP header */
+	bpf_stmt(prog, BPF_LD | BPF_W | BPF_LEN, 0);
+	bpf_stmt(prog, BPF_MISC | BPF_TAX, 0);
+
+	/* probes are 12 bytes long, reports at least 5 */
+	bpf_stmt(prog, BPF_LD | BPF_B | BPF_ABS, UDP_PAYLOAD + 3);
+	bpf_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, 0, -1, body + 10);
+	bpf_stmt(prog, BPF_MISC | BPF_TXA, 0);
+	bpf_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, UDP_PAYLOAD + 12, accept, drop);
+	bpf_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, 1, -1, drop);
+	bpf_stmt(prog, BPF_MISC | BPF_TXA, 0);
+	bpf_jump(prog, BPF_JMP | BPF_JGE | BPF_K, UDP_PAYLOAD + 5, accept, drop);
+
+	bpf_stmt(prog, BPF_RET | BPF_K, 0xffffffff);
+	bpf_stmt(prog, BPF_RET | BPF_K, 0);
+}
+
+bool AttachBeaconFilter(int sock, const std::vector<address> &self) {
+	std::vector<sock_filter> prog;
+
+	build_beacon_filter(prog, self);
+
+	sock_fprog fprog;
+	fprog.len = prog.size();
+	fprog.filter = &prog[0];
+
+	return setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == 0;
+}
+
+#else
+
+bool AttachBeaconFilter(int, const std::vector<address> &) {
+	errno = ENOSYS;
+	return false;
+}
+
+#endif
+
+uint32_t SocketDrops(int sock) {
+#if defined(__linux__) && defined(SO_MEMINFO)
+	uint32_t info[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, info, &len) == 0 && len > SK_MEMINFO_DROPS * sizeof(uint32_t))
+		return info[SK_MEMINFO_DROPS];
+#endif
+
+	return 0;
+}
+
 bool RequireToAddress(int sock, const address &addr) {
 #ifdef IPV6_PKTINFO
 	if (addr.family() == AF_INET6) {
 		int on = 1;
+#ifdef IPV6_RECVPKTINFO
+		/* RFC 3542, IPV6_PKTINFO is the sticky option there */
+		return setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) == 0;
+#else
 		return setsockopt(sock, IPPROTO_IPV6, IPV6_PKTINFO, &on, sizeof(on)) == 0;
+#endif
 	}
 #endif
 
 	return true;
 }
 
-int RecvMsg(int sock, address &from, address &to, uint8_t *buffer, int buflen, int &ttl, uint64_t &ts) {
-	int len;
-	struct msghdr msg;
-	struct iovec iov;
-	uint8_t ctlbuf[64];
-
-	from.set_family(beaconUnicastAddr.family());
-
-	msg.msg_name = (char *)from.saddr();
-	msg.msg_namelen = from.addrlen();
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = (char *)ctlbuf;
-	msg.msg_controllen = sizeof(ctlbuf);
-	msg.msg_flags = 0;
-
-	iov.iov_base = (char *)buffer;
-	iov.iov_len = buflen;
-
-	len = recvmsg(sock, &msg, 0);
-	if (len < 0)
-		return len;
-
+void read_ancillary(msghdr &msg, const address &from, address &to, int &ttl, uint64_t &ts) {
 	ts = 0;
 	ttl = 127;
 
-	to = beaconUnicastAddr;
+	to = LocalAddress(from.family());
 
 	if (msg.msg_controllen > 0) {
 		for (cmsghdr *hdr = CMSG_FIRSTHDR(&msg); hdr; hdr = CMSG_NXTHDR(&msg, hdr)) {
@@ -312,10 +566,87 @@ int RecvMsg(int sock, address &from, address &to, uint8_t *buffer, int buflen, i
 	if (!ts) {
 		ts = get_time_of_day();
 	}
+}
+
+int RecvMsg(int sock, address &from, address &to, uint8_t *buffer, int buflen, int &ttl, uint64_t &ts) {
+	int len;
+	struct msghdr msg;
+	struct iovec iov;
+	uint8_t ctlbuf[64];
+
+	/* room for either family, the kernel fills in which */
+	from.set_family(AF_INET6);
+
+	msg.msg_name = (char *)from.saddr();
+	msg.msg_namelen = from.addrlen();
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = (char *)ctlbuf;
+	msg.msg_controllen = sizeof(ctlbuf);
+	msg.msg_flags = 0;
+
+	iov.iov_base = (char *)buffer;
+	iov.iov_len = buflen;
+
+	len = recvmsg(sock, &msg, 0);
+	if (len < 0)
+		return len;
+
+	read_ancillary(msg, from, to, ttl, ts);
 
 	return len;
 }
 
+int RecvMsgs(int sock, Message *msgs, uint8_t *buffers, int buflen, int count) {
+#ifdef MSG_WAITFORONE
+	static mmsghdr hdrs[RECV_BATCH];
+	static iovec iovs[RECV_BATCH];
+	static uint8_t ctlbufs[RECV_BATCH][64];
+
+	if (count > RECV_BATCH)
+		count = RECV_BATCH;
+
+	for (int k = 0; k < count; k++) {
+		msgs[k].from.set_family(AF_INET6);
+		msgs[k].buffer = buffers + k * buflen;
+
+		iovs[k].iov_base = (char *)msgs[k].buffer;
+		iovs[k].iov_len = buflen;
+
+		msghdr &msg = hdrs[k].msg_hdr;
+
+		msg.msg_name = (char *)msgs[k].from.saddr();
+		msg.msg_namelen = msgs[k].from.addrlen();
+		msg.msg_iov = &iovs[k];
+		msg.msg_iovlen = 1;
+		msg.msg_control = (char *)ctlbufs[k];
+		msg.msg_controllen = sizeof(ctlbufs[k]);
+		msg.msg_flags = 0;
+	}
+
+	int n = recvmmsg(sock, hdrs, count, MSG_DONTWAIT, 0);
+
+	for (int k = 0; k < n; k++) {
+		msgs[k].len = hdrs[k].msg_len;
+		read_ancillary(hdrs[k].msg_hdr, msgs[k].from, msgs[k].to, msgs[k].ttl, msgs[k].timestamp);
+	}
+
+	return n;
+#else
+	Message &m = msgs[0];
+
+	m.buffer = buffers;
+
+	int len = RecvMsg(sock, m.from, m.to, m.buffer, buflen, m.ttl, m.timestamp);
+	if (len < 0)
+		return len;
+
+	m.len = len;
+
+	return 1;
+#endif
+}
+
 int SendTo(int sock, const uint8_t *buffer, int len, const address &from, const address &to) {
 #ifdef IPV6_PKTINFO
 	if (from.family() == AF_INET6) {
@@ -551,26 +882,83 @@ bool address::copy_address(const address &source) {
 	return true;
 }
 
-uint64_t get_timestamp() {
-	struct tms tmp;
+static void read_system_clock(uint64_t &timestamp, uint64_t &timeofday) {
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
 
-	uint64_t v = times(&tmp);
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		timestamp = ts.tv_sec;
+		timestamp *= 1000;
+		timestamp += ts.tv_nsec / 1000000;
+	} else
+#endif
+	{
+		struct tms tmp;
 
-	return (v * 1000) / sysconf(_SC_CLK_TCK);
+		uint64_t v = times(&tmp);
+
+		timestamp = (v * 1000) / sysconf(_SC_CLK_TCK);
+	}
+
+	struct timeval tv;
+
+	if (gettimeofday(&tv, 0) != 0) {
+		timeofday = 0;
+	} else {
+		timeofday = tv.tv_sec;
+		timeofday *= 1000;
+		timeofday += tv.tv_usec / 1000;
+	}
+}
+
+/* Both clocks are read once per pass of the event loop, everything in
+ * between sees the same instant */
+static ClockSource clockSource = read_system_clock;
+static uint64_t currentTimestamp = 0, currentTimeOfDay = 0;
+
+void update_clock() {
+	clockSource(currentTimestamp, currentTimeOfDay);
+}
+
+void set_clock_source(ClockSource source) {
+	clockSource = source ? source : read_system_clock;
+	update_clock();
+}
+
+uint64_t get_timestamp() {
+	return currentTimestamp;
 }
 
 uint64_t get_time_of_day() {
-	struct timeval tv;
-	uint64_t timestamp;
+	return currentTimeOfDay;
+}
 
-	if (gettimeofday(&tv, 0) != 0)
-		return 0;
+bool SetCPUAffinity(int cpu) {
+#if defined(__linux__) && defined(CPU_SET)
+	cpu_set_t set;
 
-	timestamp = tv.tv_sec;
-	timestamp *= 1000;
-	timestamp += tv.tv_usec / 1000;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
 
-	return timestamp;
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+bool SetRealtimePriority(int priority) {
+#ifdef SCHED_FIFO
+	sched_param param;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+
+	return sched_setscheduler(0, SCHED_FIFO, &param) == 0;
+#else
+	errno = ENOSYS;
+	return false;
+#endif
 }
 
 int
@@ -612,7 +1000,7 @@ dbeacon_daemonize(const char *pidfile)
 	return 0;
 }
 
-address get_local_address_for(const address &remote)
+address get_local_address_for(const address &remote, int ifindex)
 {
 	int tmpSock = socket(remote.family(), SOCK_DGRAM, 0);
 	if (tmpSock < 0) {
@@ -620,6 +1008,12 @@ address get_local_address_for(const address &remote)
 		exit(-1);
 	}
 
+	/* the route to a group goes through the multicast interface */
+	if (ifindex && !SetMulticastInterface(tmpSock, remote, ifindex)) {
+		perror("Failed to set multicast interface");
+		exit(-1);
+	}
+
 	if (connect(tmpSock, remote.saddr(), remote.addrlen()) != 0) {
 		perror("Failed to connect multicast socket");
 		exit(-1);
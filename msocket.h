@@ -8,18 +8,72 @@
 
 #include "address.h"
 
+#include <vector>
+
+struct Message;
+
 void MulticastStartup();
 
-int MulticastListen(int sock, const address &);
-int SSMJoin(int sock, const address &, const address &);
-int SSMLeave(int sock, const address &, const address &);
+/* `ifindex' is the interface groups are joined on, 0 for any */
+int MulticastListen(int sock, const address &, int ifindex);
+int SSMJoin(int sock, const address &, const address &, int ifindex);
+int SSMLeave(int sock, const address &, const address &, int ifindex);
+int SSMSetFilter(int sock, const address &, const address *, int count, int ifindex);
 
-int SetupSocket(const address &, bool bind, bool ssm);
+/* Sockets of an interface only receive what arrives through it */
+int SetupSocket(const address &, bool bind, bool ssm, int ifindex);
 bool SetHops(int sock, const address &, int);
 bool RequireToAddress(int sock, const address &);
+bool SetMulticastLoop(int sock, const address &, bool);
+bool SetMulticastInterface(int sock, const address &, int ifindex);
+
+/* Makes the kernel drop anything but beacon probes and reports, and the
+ * packets sent from any of `self'. Fails with ENOSYS where socket filters
+ * are not supported. */
+bool AttachBeaconFilter(int sock, const std::vector<address> &self);
+/* Packets the kernel dropped for the socket, rejected by its filter or
+ * not fitting in the receive buffer */
+uint32_t SocketDrops(int sock);
 
 int RecvMsg(int, address &from, address &to, uint8_t *buffer, int len, int &ttl, uint64_t &ts);
+
+/* Receives up to `count' pending messages without blocking, into
+ * consecutive `buflen' sized buffers */
+#define RECV_BATCH	16
+int RecvMsgs(int, Message *, uint8_t *buffers, int buflen, int count);
 int SendTo(int, const uint8_t *, int len, const address &from, const address &to);
 
+/* Destination, TTL and reception time of a received message */
+void read_ancillary(msghdr &, const address &from, address &to, int &ttl, uint64_t &ts);
+
+/* io_uring engine, Linux only. Receives stay posted on every listened
+ * socket, using buffers `payload' bytes long, and sends are queued, both
+ * are submitted in UringWait() which also waits up to `wait' ms for them
+ * to complete. UringDispatch() handles the completions, it fails if the
+ * kernel turns the receives down, UringClose() then drops them all. */
+bool UringSetup(int payload);
+void UringListen(int sock);
+int UringSendTo(int, const uint8_t *, int len, const address &to);
+int UringWait(uint32_t wait);
+int UringDispatch(void (*)(int sock, const Message &));
+void UringClose();
+
+/* Passive capture of the beacon traffic seen on an interface through a
+ * TPACKET_V3 ring, Linux only. CaptureRead() hands every captured probe
+ * and report to `handler' in place, from the ring. */
+int CaptureSetup(const char *ifname);
+/* Fills `msg' but for the timestamp from the UDP over IPv4 or IPv6 packet
+ * at `net', pointing the payload into it */
+bool ParsePacket(uint8_t *net, uint32_t len, Message &msg, bool &ssm);
+void CaptureRead(void (*handler)(const Message &, bool ssm));
+void CaptureStats(uint64_t &packets, uint64_t &drops);
+
+/* AF_XDP socket on the first queue of an interface, Linux only. An XDP
+ * program steers UDP to `port' into it, everything else goes on to the
+ * stack. XdpRead() hands the messages to `handler' in place, from UMEM. */
+int XdpSetup(const char *ifname, int port);
+void XdpRead(void (*handler)(const Message &, bool ssm));
+void XdpStats(uint64_t &packets, uint64_t &drops);
+
 #endif
 
@@ -0,0 +1,294 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#include "dbeacon.h"
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static vector<uint32_t> freeIds;
+static uint32_t nextId = LOCAL_ID + 1;
+
+uint32_t allocate_source_id() {
+	if (freeIds.empty())
+		return nextId++;
+
+	uint32_t id = freeIds.back();
+	freeIds.pop_back();
+	return id;
+}
+
+void release_source_id(uint32_t id) {
+	freeIds.push_back(id);
+}
+
+/* ids are released as soon as their source goes, so with a limited
+ * source table none reaches past this stride. 0 without a limit */
+static uint32_t stride_limit() {
+	if (maxSources == 0)
+		return 0;
+
+	return (LOCAL_ID + 1 + maxSources + PAIR_BLOCK - 1) / PAIR_BLOCK * PAIR_BLOCK;
+}
+
+/* open addressing with linear probing, at most half full */
+static vector<beaconSource *> sourceIndex(64, (beaconSource *)0);
+static uint32_t indexed = 0;
+
+static uint32_t hash_address(const address &addr) {
+	const uint8_t *p;
+	int len;
+	uint16_t port;
+
+	if (addr.family() == AF_INET6) {
+		p = (const uint8_t *)&addr.v6()->sin6_addr;
+		len = sizeof(in6_addr);
+		port = addr.v6()->sin6_port;
+	} else {
+		p = (const uint8_t *)&addr.v4()->sin_addr;
+		len = sizeof(in_addr);
+		port = addr.v4()->sin_port;
+	}
+
+	/* FNV-1a */
+	uint32_t h = 2166136261U ^ addr.family() ^ ((uint32_t)port << 16);
+
+	for (int i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619U;
+
+	return h;
+}
+
+static void index_insert(beaconSource *src) {
+	uint32_t mask = sourceIndex.size() - 1;
+	uint32_t k = hash_address(src->addr) & mask;
+
+	while (sourceIndex[k])
+		k = (k + 1) & mask;
+
+	sourceIndex[k] = src;
+}
+
+void index_source(beaconSource *src) {
+	if ((indexed + 1) * 2 > sourceIndex.size()) {
+		vector<beaconSource *> old(sourceIndex.size() * 2, (beaconSource *)0);
+		old.swap(sourceIndex);
+
+		for (uint32_t k = 0; k < old.size(); k++) {
+			if (old[k])
+				index_insert(old[k]);
+		}
+	}
+
+	index_insert(src);
+	indexed++;
+}
+
+void unindex_source(const beaconSource *src) {
+	uint32_t mask = sourceIndex.size() - 1;
+	uint32_t k = hash_address(src->addr) & mask;
+
+	while (sourceIndex[k] != src) {
+		if (sourceIndex[k] == 0)
+			return;
+		k = (k + 1) & mask;
+	}
+
+	sourceIndex[k] = 0;
+	indexed--;
+
+	/* move back the entries that probed past the freed slot */
+	for (uint32_t j = (k + 1) & mask; sourceIndex[j]; j = (j + 1) & mask) {
+		uint32_t home = hash_address(sourceIndex[j]->addr) & mask;
+
+		if (((j - home) & mask) >= ((j - k) & mask)) {
+			sourceIndex[k] = sourceIndex[j];
+			sourceIndex[j] = 0;
+			k = j;
+		}
+	}
+}
+
+beaconSource *find_source(const address &addr) {
+	uint32_t mask = sourceIndex.size() - 1;
+
+	for (uint32_t k = hash_address(addr) & mask; sourceIndex[k]; k = (k + 1) & mask) {
+		if (sourceIndex[k]->addr.compare(addr) == 0)
+			return sourceIndex[k];
+	}
+
+	return 0;
+}
+
+pairMatrix::pairMatrix()
+	: stride(0) {
+}
+
+template<typename T>
+static void relayout(vector<T> &v, uint32_t from, uint32_t to) {
+	vector<T> n((size_t)to * to, T());
+
+	for (uint32_t r = 0; r < from; r++) {
+		for (uint32_t c = 0; c < from; c++)
+			n[(size_t)r * to + c] = v[(size_t)r * from + c];
+	}
+
+	v.swap(n);
+}
+
+void pairMatrix::reserve(uint32_t id) {
+	if (id < stride)
+		return;
+
+	/* grow by half in whole blocks, but not past what the source table
+	 * can fill, the matrix is quadratic in the stride */
+	uint32_t n = stride + stride / 2;
+	if (n <= id)
+		n = id + 1;
+	n = (n + PAIR_BLOCK - 1) / PAIR_BLOCK * PAIR_BLOCK;
+
+	uint32_t limit = stride_limit();
+	if (limit && n > limit)
+		n = max(limit, (id + PAIR_BLOCK) / PAIR_BLOCK * PAIR_BLOCK);
+
+	for (int ch = 0; ch < CHANNELS; ch++) {
+		relayout(updated[ch], stride, n);
+		relayout(delay[ch], stride, n);
+		relayout(jitter[ch], stride, n);
+		relayout(loss[ch], stride, n);
+		relayout(present[ch], stride, n);
+		relayout(alive[ch], stride, n);
+	}
+
+	relayout(entry, stride, n);
+
+	stride = n;
+}
+
+void pairMatrix::prepare() {
+	uint32_t want = nextId + PAIR_BLOCK;
+
+	uint32_t limit = stride_limit();
+	if (limit && want > limit)
+		want = limit;
+
+	if (want > stride)
+		reserve(want - 1);
+}
+
+beaconExternalStats *pairMatrix::cell(uint32_t row, uint32_t col) const {
+	if (row >= stride || col >= stride)
+		return 0;
+
+	return entry[(size_t)row * stride + col];
+}
+
+void pairMatrix::update(uint32_t row, beaconExternalStats *ext, uint32_t col, uint64_t now) {
+	if (ext->subject != col)
+		clear(ext);
+
+	reserve(row > col ? row : col);
+
+	size_t cell = (size_t)row * stride + col;
+
+	ext->subject = col;
+	entry[cell] = ext;
+
+	for (int ch = 0; ch < CHANNELS; ch++) {
+		const Stats &st = ch == ASM_CHANNEL ? ext->ASM : ext->SSM;
+
+		if (!st.valid || st.lastupdate != now)
+			continue;
+
+		updated[ch][cell] = (uint32_t)now;
+		delay[ch][cell] = st.avgdelay;
+		jitter[ch][cell] = st.avgjitter;
+		loss[ch][cell] = st.avgloss;
+		present[ch][cell] = 1;
+	}
+}
+
+void pairMatrix::update_row(uint32_t row, const rowUpdate *upd, uint32_t count, uint64_t now) {
+	uint32_t top = row;
+	for (uint32_t i = 0; i < count; i++) {
+		if (upd[i].col > top)
+			top = upd[i].col;
+	}
+
+	reserve(top);
+
+	for (uint32_t i = 0; i < count; i++)
+		update(row, upd[i].ext, upd[i].col, now);
+}
+
+static void clear_cell(pairMatrix &m, size_t cell) {
+	for (int ch = 0; ch < pairMatrix::CHANNELS; ch++)
+		m.present[ch][cell] = m.alive[ch][cell] = 0;
+	m.entry[cell] = 0;
+}
+
+void pairMatrix::clear(const beaconExternalStats *ext) {
+	if (ext->subject == NO_ID || ext->owner == 0)
+		return;
+
+	size_t cell = (size_t)ext->owner->source->id * stride + ext->subject;
+	if (cell < entry.size() && entry[cell] == ext)
+		clear_cell(*this, cell);
+}
+
+void pairMatrix::clear_source(uint32_t id) {
+	if (id >= stride)
+		return;
+
+	for (uint32_t k = 0; k < stride; k++) {
+		clear_cell(*this, (size_t)id * stride + k);
+		clear_cell(*this, (size_t)k * stride + id);
+	}
+}
+
+uint32_t pairMatrix::sweep(uint64_t now, uint32_t timeout) {
+	const uint32_t t = (uint32_t)now;
+	const size_t cells = (size_t)stride * stride;
+
+	uint32_t count = 0;
+
+	for (int ch = 0; ch < CHANNELS; ch++) {
+		const uint32_t *upd = cells ? &updated[ch][0] : 0;
+		const uint8_t *pres = cells ? &present[ch][0] : 0;
+		uint8_t *alv = cells ? &alive[ch][0] : 0;
+
+		for (size_t i = 0; i < cells; i += PAIR_BLOCK) {
+			uint8_t block[PAIR_BLOCK];
+			uint8_t n = 0;
+
+			/* fixed length, branch free and writing to a local
+			 * block, so it becomes a handful of vector
+			 * instructions */
+			for (int k = 0; k < PAIR_BLOCK; k++) {
+				block[k] = pres[i + k] & ((uint32_t)(t - upd[i + k]) <= timeout);
+				n += block[k];
+			}
+
+			memcpy(alv + i, block, PAIR_BLOCK);
+			count += n;
+		}
+	}
+
+	return count;
+}
+
+bool pairMatrix::is_alive(const beaconExternalStats &ext, int ch) const {
+	if (ext.subject == NO_ID || ext.owner == 0 || ext.owner->source->id >= stride)
+		return false;
+
+	size_t cell = (size_t)ext.owner->source->id * stride + ext.subject;
+
+	return entry[cell] == &ext && alive[ch][cell];
+}
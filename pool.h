@@ -0,0 +1,113 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#ifndef _pool_h_
+#define _pool_h_
+
+#include <stddef.h>
+#include <new>
+
+/* Pool of fixed size nodes. Nodes are carved out of large slabs and
+ * recycled through a free list, so the nodes of a table are packed next
+ * to each other instead of being spread over the heap, and creating or
+ * removing an entry doesn't go through malloc. Slabs are never returned
+ * to the system. */
+struct nodePool {
+	nodePool(size_t size);
+
+#define POOL_SLAB_BYTES	65536
+
+	size_t size;
+	/* nodes carved out of slabs and nodes handed out */
+	size_t reserved, inuse;
+
+	void *freelist;
+	char *slabpos, *slabend;
+
+	/* all pools, for reporting */
+	nodePool *next;
+	static nodePool *pools;
+
+	void *alloc() {
+		if (freelist) {
+			void *p = freelist;
+			freelist = *(void **)p;
+			inuse++;
+			return p;
+		}
+
+		if (slabpos == slabend)
+			grow();
+
+		void *p = slabpos;
+		slabpos += size;
+		inuse++;
+		return p;
+	}
+
+	void release(void *p) {
+		*(void **)p = freelist;
+		freelist = p;
+		inuse--;
+	}
+
+	void grow();
+};
+
+/* Bytes reserved by and used in all pools */
+void pool_usage(size_t &reserved, size_t &used);
+
+/* Allocator handing out single nodes from a pool shared by all containers
+ * of the same node type. Requests for several objects at once go to the
+ * heap. */
+template<typename T>
+class poolAllocator {
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template<typename U> struct rebind { typedef poolAllocator<U> other; };
+
+	poolAllocator() {}
+	poolAllocator(const poolAllocator &) {}
+	template<typename U> poolAllocator(const poolAllocator<U> &) {}
+
+	pointer address(reference r) const { return &r; }
+	const_pointer address(const_reference r) const { return &r; }
+
+	pointer allocate(size_type n, const void * = 0) {
+		if (n == 1)
+			return (pointer)pool().alloc();
+		return (pointer)::operator new(n * sizeof(T));
+	}
+
+	void deallocate(pointer p, size_type n) {
+		if (n == 1)
+			pool().release(p);
+		else
+			::operator delete(p);
+	}
+
+	size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+	void construct(pointer p, const T &v) { new ((void *)p) T(v); }
+	void destroy(pointer p) { p->~T(); }
+
+	bool operator==(const poolAllocator &) const { return true; }
+	bool operator!=(const poolAllocator &) const { return false; }
+
+private:
+	static nodePool &pool() {
+		static nodePool p(sizeof(T));
+		return p;
+	}
+};
+
+#endif
@@ -93,7 +93,39 @@ static bool write_tlv_stats(uint8_t *buff, int maxlen, int &ptr, uint8_t type,
 	return true;
 }
 
-int build_report(uint8_t *buff, int maxlen, int type, bool publishsources) {
+/* Protocol method. writes the delay and jitter percentiles of a Stats block */
+static bool write_tlv_percentiles(uint8_t *buff, int maxlen, int &ptr,
+			uint8_t type, const Stats &s) {
+	if (!write_tlv_start(buff, maxlen, ptr, type, PCOUNT * 8))
+		return false;
+
+	for (int k = 0; k < PCOUNT; k++) {
+		write_f(buff + ptr + k * 4, s.pdelay[k]);
+		write_f(buff + ptr + (PCOUNT + k) * 4, s.pjitter[k]);
+	}
+
+	ptr += PCOUNT * 8;
+
+	return true;
+}
+
+static inline int stats_tlv_len(const Stats &s, uint64_t now, bool percentiles) {
+	if (!s.is_valid(now))
+		return 0;
+	return 22 + (percentiles && s.pvalid ? 2 + PCOUNT * 8 : 0);
+}
+
+/* size of a source's stats entry with its TLV header, 0 if it has none */
+static inline int source_entry_len(const address &addr, const sessionSource &src,
+				   uint64_t now, bool percentiles) {
+	int len = stats_tlv_len(src.ASM.s, now, percentiles)
+		+ stats_tlv_len(src.SSM.s, now, percentiles);
+	if (len == 0)
+		return 0;
+	return 2 + (addr.family() == AF_INET ? 6 : 18) + len;
+}
+
+int build_report(const beaconSession &session, uint8_t *buff, int maxlen, int type, bool publishsources) {
 	if (maxlen < 4)
 		return -1;
 
@@ -135,11 +167,30 @@ int build_report(uint8_t *buff, int maxlen, int type, bool publishsources) {
 	if (publishsources) {
 		uint64_t now = get_timestamp();
 
-		for (Sources::const_iterator i = sources.begin(); i != sources.end(); i++) {
-			if (type == MAP_REPORT && !i->second.identified)
+		/* The percentiles more than double the size of an entry. They are
+		 * only added while what is left of the packet still fits the plain
+		 * entries of all the sources after this one, so they never push a
+		 * source out of the report. */
+		int plain = 0;
+		if (type != MAP_REPORT) {
+			for (SessionSources::const_iterator i = session.sources.begin();
+					i != session.sources.end(); i++)
+				plain += source_entry_len(i->first, i->second, now, false);
+		}
+
+		int dropped = 0;
+
+		for (SessionSources::const_iterator i = session.sources.begin();
+				i != session.sources.end(); i++) {
+			const beaconSource &src = *i->second.source;
+
+			if (type == MAP_REPORT && !src.identified)
 				continue;
 
-			if (!i->second.ASM.s.valid && !i->second.SSM.s.valid)
+			bool asmvalid = i->second.ASM.s.is_valid(now);
+			bool ssmvalid = i->second.SSM.s.is_valid(now);
+
+			if (!asmvalid && !ssmvalid)
 				continue;
 
 			int len = 18;
@@ -147,16 +198,24 @@ int build_report(uint8_t *buff, int maxlen, int type, bool publishsources) {
 			if (i->first.family() == AF_INET)
 				len = 6;
 
+			bool percentiles = false;
+
 			if (type == MAP_REPORT) {
-				int namelen = i->second.name.size();
-				int contactlen = i->second.adminContact.size();
+				int namelen = src.name.size();
+				int contactlen = src.adminContact.size();
 				len += 2 + namelen + 2 + contactlen;
 			} else {
-				len += (i->second.ASM.s.valid ? 22 : 0) + (i->second.SSM.s.valid ? 22 : 0);
+				plain -= source_entry_len(i->first, i->second, now, false);
+				percentiles = ptr + source_entry_len(i->first, i->second, now, true)
+					+ plain <= maxlen;
+				len += stats_tlv_len(i->second.ASM.s, now, percentiles)
+					+ stats_tlv_len(i->second.SSM.s, now, percentiles);
 			}
 
-			if (!write_tlv_start(buff, maxlen, ptr, i->first.family() == AF_INET6 ? T_SOURCE_INFO : T_SOURCE_INFO_IPv4, len))
-				break;
+			if (!write_tlv_start(buff, maxlen, ptr, i->first.family() == AF_INET6 ? T_SOURCE_INFO : T_SOURCE_INFO_IPv4, len)) {
+				dropped++;
+				continue;
+			}
 
 			if (i->first.family() == AF_INET6) {
 				const sockaddr_in6 *addr = i->first.v6();
@@ -175,17 +234,27 @@ int build_report(uint8_t *buff, int maxlen, int type, bool publishsources) {
 			}
 
 			if (type == MAP_REPORT) {
-				write_tlv_string(buff, maxlen, ptr, T_BEAC_NAME, i->second.name.c_str());
-				write_tlv_string(buff, maxlen, ptr, T_ADMIN_CONTACT, i->second.adminContact.c_str());
+				write_tlv_string(buff, maxlen, ptr, T_BEAC_NAME, src.name.c_str());
+				write_tlv_string(buff, maxlen, ptr, T_ADMIN_CONTACT, src.adminContact.c_str());
 			} else {
 				uint32_t age = (now - i->second.creation) / 1000;
 
-				if (i->second.ASM.s.valid)
-					write_tlv_stats(buff, maxlen, ptr, T_ASM_STATS, age, i->second.sttl, i->second.ASM);
-				if (i->second.SSM.s.valid)
-					write_tlv_stats(buff, maxlen, ptr, T_SSM_STATS, age, i->second.sttl, i->second.SSM);
+				if (asmvalid) {
+					write_tlv_stats(buff, maxlen, ptr, T_ASM_STATS, age, src.sttl, i->second.ASM);
+					if (percentiles && i->second.ASM.s.pvalid)
+						write_tlv_percentiles(buff, maxlen, ptr, T_ASM_PERCENTILES, i->second.ASM.s);
+				}
+				if (ssmvalid) {
+					write_tlv_stats(buff, maxlen, ptr, T_SSM_STATS, age, src.sttl, i->second.SSM);
+					if (percentiles && i->second.SSM.s.pvalid)
+						write_tlv_percentiles(buff, maxlen, ptr, T_SSM_PERCENTILES, i->second.SSM.s);
+				}
 			}
 		}
+
+		if (dropped && verbose > 1)
+			info("Report for %s left out %i sources, no room in the packet.",
+			     session.name.c_str(), dropped);
 	}
 
 	return ptr;
@@ -259,16 +328,44 @@ static bool read_tlv_stats(uint8_t *tlv, beaconExternalStats &extb, Stats &st) {
 	return true;
 }
 
-static inline bool check_string(char *hd, int len, string &result) {
+static bool read_tlv_percentiles(uint8_t *tlv, Stats &st) {
+	if (tlv[1] != PCOUNT * 8)
+		return false;
+
+	for (int k = 0; k < PCOUNT; k++) {
+		st.pdelay[k] = read_f(tlv + 2 + k * 4);
+		st.pjitter[k] = read_f(tlv + 2 + (PCOUNT + k) * 4);
+	}
+
+	st.pvalid = true;
+
+	return true;
+}
+
+/* Validates a string TLV in place, without copying it out of the buffer */
+static inline bool check_string(const uint8_t *hd, int len) {
 	for (int i = 0; i < len; i++) {
 		if (!isprint(hd[i]))
 			return false;
 	}
-	result = string(hd, len);
 	return true;
 }
 
-void handle_nmsg(const address &from, uint64_t recvdts, int ttl, uint8_t *buff, int len, bool ssm) {
+/* Only touches `result` when the value changed, which is rarely the case */
+static inline void update_string(string &result, const uint8_t *hd, int len) {
+	if (result.compare(0, string::npos, (const char *)hd, len) != 0)
+		result.assign((const char *)hd, len);
+}
+
+static inline void update_interned(const string *&result, const uint8_t *hd, int len) {
+	if (result->compare(0, string::npos, (const char *)hd, len) != 0) {
+		const string *old = result;
+		result = intern_string((const char *)hd, len);
+		release_string(old);
+	}
+}
+
+void handle_nmsg(beaconSession &session, const address &from, uint64_t recvdts, int ttl, uint8_t *buff, int len, bool ssm) {
 	if (len < 4)
 		return;
 
@@ -284,14 +381,23 @@ void handle_nmsg(const address &from, uint64_t recvdts, int ttl, uint8_t *buff,
 		if (len == 12) {
 			uint32_t seq = read_u32(buff + 4);
 			uint32_t ts = read_u32(buff + 8);
-			getSource(from, 0, now, recvdts, true).update(ttl, seq, ts, now, recvdts, ssm);
+			sessionSource *src = getSessionSource(session, from, 0, now, recvdts, true);
+			if (src)
+				src->update(ttl, seq, ts, now, recvdts, ssm);
 		}
 		return;
 	} else if (buff[3] == 1) {
 		if (len < 5)
 			return;
 
-		beaconSource &src = getSource(from, 0, now, recvdts, true);
+		sessionSource *view = getSessionSource(session, from, 0, now, recvdts, true);
+		if (view == NULL)
+			return;
+
+		beaconSource &src = *view->source;
+
+		static vector<pairMatrix::rowUpdate> rowUpdates;
+		rowUpdates.clear();
 
 		src.sttl = buff[4];
 
@@ -305,11 +411,11 @@ void handle_nmsg(const address &from, uint64_t recvdts, int ttl, uint8_t *buff,
 			}
 
 			if (hd[0] == T_BEAC_NAME) {
-				string name;
-				if (check_string((char *)hd + 2, hd[1], name))
-					src.setName(name);
+				if (check_string(hd + 2, hd[1]))
+					src.setName((const char *)hd + 2, hd[1]);
 			} else if (hd[0] == T_ADMIN_CONTACT) {
-				check_string((char *)hd + 2, hd[1], src.adminContact);
+				if (check_string(hd + 2, hd[1]))
+					update_string(src.adminContact, hd + 2, hd[1]);
 			} else if (hd[0] == T_SOURCE_INFO || hd[0] == T_SOURCE_INFO_IPv4) {
 				int blen = hd[0] == T_SOURCE_INFO ? 18 : 6;
 
@@ -334,48 +440,80 @@ void handle_nmsg(const address &from, uint64_t recvdts, int ttl, uint8_t *buff,
 					memcpy(&a4->sin_port, hd + 6, sizeof(uint16_t));
 				}
 
-				beaconExternalStats &stats = src.getExternal(addr, now, recvdts);
+				/* resolve the source first, so that its entry is
+				 * found without searching our maps */
+				bool local = IsLocalAddress(addr);
+				uint32_t subject = local ? LOCAL_ID : NO_ID;
+
+				if (!local) {
+					beaconSource *t = find_source(addr);
+					if (t)
+						subject = t->id;
+				}
+
+				beaconExternalStats *statsp = view->getExternal(addr, subject, now, recvdts);
+				if (statsp == NULL)
+					continue;
+
+				beaconExternalStats &stats = *statsp;
 
 				int plen = hd[1] - blen;
 				for (uint8_t *pd = tlv_begin(hd + 2 + blen, plen); pd; pd = tlv_next(pd, plen)) {
 					if (pd[0] == T_BEAC_NAME) {
-						if (check_string((char *)pd + 2, pd[1], stats.name)) {
-							stats.identified = !stats.name.empty();
+						if (check_string(pd + 2, pd[1])) {
+							update_interned(stats.name, pd + 2, pd[1]);
+							stats.identified = !stats.name->empty();
 						}
 					} else if (pd[0] == T_ADMIN_CONTACT) {
-						check_string((char *)pd + 2, pd[1], stats.contact);
+						if (check_string(pd + 2, pd[1]))
+							update_interned(stats.contact, pd + 2, pd[1]);
 					} else if (pd[0] == T_ASM_STATS || pd[0] == T_SSM_STATS) {
 						Stats *st = (pd[0] == T_ASM_STATS ? &stats.ASM : &stats.SSM);
 
 						if (!read_tlv_stats(pd, stats, *st))
 							break;
 						st->lastupdate = now;
+						/* senders include percentiles right after
+						 * the stats block when they have them */
+						st->pvalid = false;
+					} else if (pd[0] == T_ASM_PERCENTILES || pd[0] == T_SSM_PERCENTILES) {
+						Stats *st = (pd[0] == T_ASM_PERCENTILES ? &stats.ASM : &stats.SSM);
+
+						read_tlv_percentiles(pd, *st);
 					}
 				}
 
 				// trigger local SSM join
-				if (!addr.is_equal(beaconUnicastAddr)) {
-					beaconSource &t = getSource(addr, stats.identified ? stats.name.c_str() : 0, now, recvdts, false);
-					if (t.adminContact.empty())
-						t.adminContact = stats.contact;
+				if (!local) {
+					sessionSource *t = getSessionSource(session, addr,
+						stats.identified ? stats.name->c_str() : 0, now, recvdts, false);
+					if (t && t->source->adminContact.empty())
+						t->source->adminContact = *stats.contact;
+					subject = t ? t->source->id : NO_ID;
 				}
-			} else if (hd[0] == T_WEBSITE_GENERIC || hd[0] == T_WEBSITE_LG || hd[0] == T_WEBSITE_MATRIX) {
-				string url;
-				if (check_string((char *)hd + 2, hd[1], url)) {
-					src.webSites[hd[0]] = url;
+
+				if (subject != NO_ID) {
+					pairMatrix::rowUpdate u = { &stats, subject };
+					rowUpdates.push_back(u);
 				}
+			} else if (hd[0] == T_WEBSITE_GENERIC || hd[0] == T_WEBSITE_LG || hd[0] == T_WEBSITE_MATRIX) {
+				if (check_string(hd + 2, hd[1]))
+					update_string(src.webSites[hd[0]], hd + 2, hd[1]);
 			} else if (hd[0] == T_CC) {
-				if (hd[1] == 2) {
-					src.CC = string((char *)hd + 2, 2);
-				}
+				if (hd[1] == 2)
+					update_string(src.CC, hd + 2, 2);
 			} else if (hd[0] == T_SOURCE_FLAGS) {
 				if (hd[1] == 4)
 					src.Flags = read_u32(hd + 2);
 			} else if (hd[0] == T_LEAVE) {
-				removeSource(from, false);
-				break;
+				removeSessionSource(session, from, false);
+				return;
 			}
 		}
+
+		/* then write the report's row of the matrix at once */
+		if (!rowUpdates.empty())
+			session.pairs.update_row(src.id, &rowUpdates[0], rowUpdates.size(), now);
 	}
 }
 
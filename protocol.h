@@ -18,6 +18,8 @@ enum {
 	T_SOURCE_INFO = 'I',
 	T_ASM_STATS = 'A',
 	T_SSM_STATS = 'S',
+	T_ASM_PERCENTILES = 'p',
+	T_SSM_PERCENTILES = 's',
 
 	T_SOURCE_FLAGS = 'F',
 
@@ -44,10 +46,12 @@ enum {
 	SSMPING_CAPABLE = 2
 };
 
+struct beaconSession;
+
 int build_probe(uint8_t *, int, uint32_t, uint64_t);
-int build_report(uint8_t *, int, int, bool);
+int build_report(const beaconSession &, uint8_t *, int, int, bool);
 
-void handle_nmsg(const address &from, uint64_t recvdts, int ttl, uint8_t *buffer, int len, bool);
+void handle_nmsg(beaconSession &, const address &from, uint64_t recvdts, int ttl, uint8_t *buffer, int len, bool);
 
 #endif
 
@@ -0,0 +1,560 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#include "dbeacon.h"
+#include "address.h"
+#include "msocket.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <limits.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+/*
+ * SSM join manager. Beacons register the (S,G) channels they want with
+ * CountSSMJoin()/CountSSMLeave(), which only record the change. Once per
+ * tick ApplySSMJoins() installs the full include list of every changed
+ * group with a single source filter call, or falls back to per source
+ * joins and leaves if the OS lacks the full-state API.
+ *
+ * At most ssmJoinRate new sources are joined per tick, so a large session
+ * learnt from a single report is joined gradually instead of in one burst
+ * of membership reports. Sources left by all their beacons stay joined for
+ * ssmLeaveDelay seconds, and coming back before that costs nothing.
+ *
+ * Kernels limit the number of sources a socket may include per group
+ * (net.ipv4.igmp_max_msf and net.ipv6.mld_max_msf in Linux), so sources
+ * are spread over a pool of sockets bound to the SSM channel, opened as
+ * they are needed. Each channel registered with SSMJoinSetup() has its
+ * own pool, and so has the same channel on another interface.
+ */
+
+typedef std::set<address> SourceSet;
+
+struct ssmSource {
+	ssmSource() : shard(-1), applied(false), leaveat(0) {}
+
+	/* beacons sending from this source address, none if it is
+	 * waiting to be removed from the filter */
+	SourceSet beacons;
+	/* socket of the pool this source was placed in, -1 if none */
+	int shard;
+	/* whether the source is part of that socket's filter */
+	bool applied;
+	/* when an applied source without beacons is left */
+	uint64_t leaveat;
+};
+
+typedef std::map<address, ssmSource> SourceMap;
+
+struct ssmGroup {
+	ssmGroup() : ifindex(0), maxSources(0), handler(0), dirty(false), retryAt(0) {}
+
+	/* interface the channel is joined on, 0 for any */
+	int ifindex;
+	SourceMap sources;
+	/* sockets bound to the channel and number of sources placed
+	 * in each of them */
+	vector<int> socks;
+	vector<uint32_t> load;
+	/* sources a socket takes, 0 if unknown. The limits are per family */
+	uint32_t maxSources;
+	SocketHandler handler;
+	bool dirty;
+	/* no socket is opened before then, after one failed */
+	uint64_t retryAt;
+};
+
+/* by channel and interface */
+typedef std::map<std::pair<address, int>, ssmGroup> GroupMap;
+static GroupMap groupMap;
+
+static bool pendingChanges = false;
+
+/* cleared the first time the OS rejects a full source filter */
+static bool useSourceFilter = true;
+
+/* new sources joined per tick, 0 for no limit */
+uint32_t ssmJoinRate = 50;
+/* seconds a source stays joined after its last beacon is gone */
+uint32_t ssmLeaveDelay = 60;
+
+static uint64_t tickTime;
+static uint32_t joinBudget;
+
+static uint64_t joinsApplied = 0, leavesApplied = 0, joinsFailed = 0;
+
+static uint32_t read_msf_limit(int family) {
+	const char *path = family == AF_INET6 ?
+		"/proc/sys/net/ipv6/mld_max_msf" : "/proc/sys/net/ipv4/igmp_max_msf";
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+
+	unsigned value = 0;
+	if (fscanf(f, "%u", &value) != 1)
+		value = 0;
+
+	fclose(f);
+
+	return value;
+}
+
+void SSMJoinSetup(int sock, const address &bindaddr, int ifindex, SocketHandler handler) {
+	ssmGroup &grp = groupMap[make_pair(bindaddr, ifindex)];
+
+	grp.ifindex = ifindex;
+	grp.socks.push_back(sock);
+	grp.handler = handler;
+
+	if (verbose) {
+		char tmp[64];
+		info("Registering SSM group %s", bindaddr.to_string(tmp, sizeof(tmp)));
+	}
+
+	grp.maxSources = read_msf_limit(bindaddr.family());
+
+	if (verbose && grp.maxSources)
+		info("Up to %u SSM sources per socket", grp.maxSources);
+}
+
+/* Forgets the channel. Its sockets are closed by the caller, which leaves
+ * whatever was joined through them. */
+void SSMJoinRemove(const address &bindaddr, int ifindex) {
+	GroupMap::iterator g = groupMap.find(make_pair(bindaddr, ifindex));
+	if (g == groupMap.end())
+		return;
+
+	if (verbose) {
+		char tmp[64];
+		info("Unregistering SSM group %s", bindaddr.to_string(tmp, sizeof(tmp)));
+	}
+
+	groupMap.erase(g);
+}
+
+static address source_address(const address &beacon) {
+	address source_addr;
+
+	source_addr.set_family(beacon.family());
+	source_addr.copy_address(beacon);
+	source_addr.set_port(0);
+
+	return source_addr;
+}
+
+void CountSSMJoin(const address &group, int ifindex, const address &source) {
+	char tmp[64], tmp2[64], tmp3[64];
+
+	address source_addr = source_address(source);
+
+	GroupMap::iterator g = groupMap.find(make_pair(group, ifindex));
+	if (g == groupMap.end())
+		return;
+
+	ssmSource &s = g->second.sources[source_addr];
+
+	if (s.beacons.empty()) {
+		/* cancels a pending leave */
+		s.leaveat = 0;
+		g->second.dirty = true;
+		pendingChanges = true;
+	}
+
+	if (s.beacons.insert(source).second) {
+		if (verbose)
+			info("Adding beacon %s to (%s, %s)", source.to_string(tmp, sizeof(tmp)),
+			     source_addr.to_string(tmp2, sizeof(tmp2)),
+			     group.to_string(tmp3, sizeof(tmp3)));
+	}
+}
+
+void CountSSMLeave(const address &group, int ifindex, const address &source) {
+	char tmp[64], tmp2[64], tmp3[64];
+
+	GroupMap::iterator g = groupMap.find(make_pair(group, ifindex));
+	if (g == groupMap.end())
+		return;
+
+	address source_addr = source_address(source);
+
+	SourceMap::iterator s = g->second.sources.find(source_addr);
+	if (s == g->second.sources.end() || s->second.beacons.erase(source) == 0)
+		return;
+
+	if (verbose)
+		info("Removing beacon %s from (%s, %s)", source.to_string(tmp, sizeof(tmp)),
+		     source_addr.to_string(tmp2, sizeof(tmp2)),
+		     group.to_string(tmp3, sizeof(tmp3)));
+
+	if (s->second.beacons.empty()) {
+		if (verbose)
+			info("No more beacons for (%s, %s), leaving group in %u secs",
+			     source_addr.to_string(tmp, sizeof(tmp)),
+			     group.to_string(tmp2, sizeof(tmp2)), ssmLeaveDelay);
+		s->second.leaveat = get_timestamp() + ssmLeaveDelay * 1000ULL;
+		g->second.dirty = true;
+		pendingChanges = true;
+	}
+}
+
+/* Whether the source must be part of the group's filter */
+static inline bool in_filter(const ssmSource &src) {
+	return !src.beacons.empty() || (src.applied && tickTime < src.leaveat);
+}
+
+/* Revisit the group in the next tick */
+static inline void defer(ssmGroup &grp) {
+	grp.dirty = true;
+	pendingChanges = true;
+}
+
+static bool take_join_budget(ssmGroup &grp) {
+	if (joinBudget == 0) {
+		defer(grp);
+		return false;
+	}
+
+	joinBudget--;
+	return true;
+}
+
+/* Returns a socket of the pool with room for one more source of the
+ * group, opening a new one if they are all full */
+static int shard_with_room(const address &group, ssmGroup &grp) {
+	grp.load.resize(grp.socks.size(), 0);
+
+	for (uint32_t k = 0; k < grp.load.size(); k++) {
+		if (grp.maxSources == 0 || grp.load[k] < grp.maxSources)
+			return k;
+	}
+
+	if (tickTime < grp.retryAt)
+		return -1;
+
+	/* e.g. out of descriptors, or past what select() can watch. Sources
+	 * wait for room in the sockets we have */
+	int sock = SetupSocket(group, true, true, grp.ifindex);
+	if (sock < 0) {
+		char tmp[64];
+		d_log(LOG_WARNING, "No more SSM sockets for %s, %u sources joined",
+		      group.to_string(tmp, sizeof(tmp)), (uint32_t)(grp.socks.size() * grp.maxSources));
+		grp.retryAt = tickTime + 60000;
+		return -1;
+	}
+
+	ListenTo(sock, grp.handler, grp.socks[0]);
+	grp.socks.push_back(sock);
+	grp.load.push_back(0);
+
+	if (verbose) {
+		char tmp[64];
+		info("Opened SSM socket #%u for %s", (uint32_t)grp.socks.size(),
+		     group.to_string(tmp, sizeof(tmp)));
+	}
+
+	return grp.socks.size() - 1;
+}
+
+static bool place_source(const address &group, ssmGroup &grp, ssmSource &src) {
+	int k = shard_with_room(group, grp);
+	if (k < 0)
+		return false;
+
+	src.shard = k;
+	grp.load[k]++;
+
+	return true;
+}
+
+static void unplace_source(ssmGroup &grp, ssmSource &src) {
+	grp.load[src.shard]--;
+	src.shard = -1;
+	src.applied = false;
+}
+
+typedef vector<SourceMap::iterator> ShardSources;
+
+/* Installs the include list of one socket of the pool with a single call */
+static bool apply_filter(const address &group, ssmGroup &grp, int k,
+			 ShardSources &members) {
+	static vector<address> list;
+	list.clear();
+
+	int sock = grp.socks[k];
+	bool joined = false, justjoined = false;
+
+	for (ShardSources::const_iterator i = members.begin(); i != members.end(); ++i) {
+		if (in_filter((*i)->second))
+			list.push_back((*i)->first);
+		joined = joined || (*i)->second.applied;
+	}
+
+	if (!joined && !list.empty()) {
+		/* filters may only be set on groups we are a member of */
+		if (SSMJoin(sock, group, list[0], grp.ifindex) < 0)
+			return false;
+
+		grp.sources[list[0]].applied = true;
+		joinsApplied++;
+		joined = justjoined = true;
+	}
+
+	/* a single new source is already covered by its join */
+	if (joined && !(justjoined && members.size() == 1)) {
+		if (SSMSetFilter(sock, group, list.empty() ? 0 : &list[0], list.size(),
+				 grp.ifindex) < 0)
+			return false;
+	}
+
+	if (verbose > 1) {
+		char tmp[64];
+		info("Set SSM filter of %s in socket #%u to %u sources",
+		     group.to_string(tmp, sizeof(tmp)), k + 1, (uint32_t)list.size());
+	}
+
+	for (ShardSources::iterator i = members.begin(); i != members.end(); ++i) {
+		ssmSource &src = (*i)->second;
+
+		if (!in_filter(src)) {
+			if (src.applied)
+				leavesApplied++;
+			unplace_source(grp, src);
+			grp.sources.erase(*i);
+		} else if (!src.applied) {
+			src.applied = true;
+			joinsApplied++;
+		}
+	}
+
+	return true;
+}
+
+/* The socket took fewer sources than we expected: remember its real
+ * limit and place the sources that didn't fit again in the next tick */
+static void shard_full(ssmGroup &grp, ShardSources &members) {
+	uint32_t applied = 0, wanted = 0;
+
+	for (ShardSources::iterator i = members.begin(); i != members.end(); ++i) {
+		if (!in_filter((*i)->second))
+			continue;
+
+		wanted++;
+
+		if ((*i)->second.applied)
+			applied++;
+		else
+			unplace_source(grp, (*i)->second);
+	}
+
+	/* we don't know by how much we went over, so aim lower
+	 * each time until it fits */
+	grp.maxSources = max(max(applied, wanted / 2), (uint32_t)1);
+
+	if (verbose)
+		info("SSM sockets take up to %u sources", grp.maxSources);
+
+	defer(grp);
+}
+
+/* Sources of the shard whose join failed */
+static void shard_failed(ShardSources &members) {
+	for (ShardSources::iterator i = members.begin(); i != members.end(); ++i) {
+		if (!(*i)->second.applied && !(*i)->second.beacons.empty())
+			joinsFailed++;
+	}
+}
+
+static bool apply_sharded(const address &group, ssmGroup &grp) {
+	static vector<ShardSources> shards;
+	char tmp[64];
+
+	shards.resize(grp.socks.size());
+	for (uint32_t k = 0; k < shards.size(); k++)
+		shards[k].clear();
+
+	static vector<bool> changed;
+	changed.assign(grp.socks.size(), false);
+
+	SourceMap::iterator i = grp.sources.begin();
+	while (i != grp.sources.end()) {
+		SourceMap::iterator j = i;
+		++i;
+
+		ssmSource &src = j->second;
+
+		if (src.beacons.empty()) {
+			if (src.shard < 0) {
+				grp.sources.erase(j);
+				continue;
+			}
+
+			if (in_filter(src)) {
+				/* still within the leave delay */
+				defer(grp);
+				shards[src.shard].push_back(j);
+				continue;
+			}
+		} else if (src.shard < 0) {
+			if (!take_join_budget(grp))
+				continue;
+
+			/* waits for room, shard_with_room() said why */
+			if (!place_source(group, grp, src)) {
+				defer(grp);
+				continue;
+			}
+
+			/* the pool may have grown */
+			shards.resize(grp.socks.size());
+			changed.resize(grp.socks.size(), false);
+		} else if (src.applied) {
+			shards[src.shard].push_back(j);
+			continue;
+		}
+
+		changed[src.shard] = true;
+		shards[src.shard].push_back(j);
+	}
+
+	for (uint32_t k = 0; k < shards.size(); k++) {
+		if (!changed[k])
+			continue;
+
+		if (apply_filter(group, grp, k, shards[k]))
+			continue;
+
+		if (errno == ENOBUFS) {
+			shard_full(grp, shards[k]);
+		} else if (errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+			return false;
+		} else {
+			d_log(LOG_WARNING, "Failed to set SSM filter of %s: %s",
+			      group.to_string(tmp, sizeof(tmp)), strerror(errno));
+			shard_failed(shards[k]);
+		}
+	}
+
+	return true;
+}
+
+/* Joins and leaves each changed source of the group */
+static void apply_single(const address &group, ssmGroup &grp) {
+	char tmp[64], tmp2[64];
+
+	SourceMap::iterator i = grp.sources.begin();
+	while (i != grp.sources.end()) {
+		SourceMap::iterator j = i;
+		++i;
+
+		ssmSource &src = j->second;
+
+		if (src.beacons.empty()) {
+			if (in_filter(src)) {
+				defer(grp);
+				continue;
+			}
+
+			if (src.applied) {
+				SSMLeave(grp.socks[src.shard], group, j->first, grp.ifindex);
+				leavesApplied++;
+			}
+			if (src.shard >= 0)
+				unplace_source(grp, src);
+			grp.sources.erase(j);
+			continue;
+		}
+
+		if (src.applied || !take_join_budget(grp))
+			continue;
+
+		if (verbose)
+			info("Joining (%s, %s)", j->first.to_string(tmp, sizeof(tmp)),
+			     group.to_string(tmp2, sizeof(tmp2)));
+
+		while (src.shard >= 0 || place_source(group, grp, src)) {
+			if (SSMJoin(grp.socks[src.shard], group, j->first, grp.ifindex) == 0) {
+				src.applied = true;
+				joinsApplied++;
+				break;
+			}
+
+			bool full = errno == ENOBUFS && grp.load[src.shard] > 1;
+
+			if (full) {
+				grp.maxSources = grp.load[src.shard] - 1;
+			} else if (verbose) {
+				info("Join failed, reason: %s", strerror(errno));
+			}
+
+			unplace_source(grp, src);
+
+			if (!full) {
+				joinsFailed++;
+				break;
+			}
+		}
+	}
+}
+
+static void apply_group(const address &group, ssmGroup &grp) {
+	if (useSourceFilter) {
+		if (apply_sharded(group, grp))
+			return;
+
+		if (verbose)
+			info("No support for SSM source filters, joining sources one by one");
+
+		useSourceFilter = false;
+	}
+
+	apply_single(group, grp);
+}
+
+void ApplySSMJoins() {
+	if (!pendingChanges)
+		return;
+
+	pendingChanges = false;
+
+	tickTime = get_timestamp();
+	joinBudget = ssmJoinRate ? ssmJoinRate : UINT_MAX;
+
+	/* groups stay registered with their socket pools */
+	for (GroupMap::iterator g = groupMap.begin(); g != groupMap.end(); ++g) {
+		if (!g->second.dirty)
+			continue;
+
+		g->second.dirty = false;
+
+		apply_group(g->first.first, g->second);
+	}
+}
+
+void GetSSMJoinStats(ssmJoinStats &st) {
+	st.pending = st.leaving = 0;
+
+	for (GroupMap::const_iterator g = groupMap.begin(); g != groupMap.end(); ++g) {
+		for (SourceMap::const_iterator i = g->second.sources.begin();
+				i != g->second.sources.end(); ++i) {
+			if (i->second.beacons.empty())
+				st.leaving += i->second.applied ? 1 : 0;
+			else if (!i->second.applied)
+				st.pending++;
+		}
+	}
+
+	st.joins = joinsApplied;
+	st.leaves = leavesApplied;
+	st.failed = joinsFailed;
+}
@@ -23,8 +23,6 @@ static const char *SSMPingV4ResponseChannel = "232.43.211.234";
 
 static address SSMPingV6Addr(AF_INET6), SSMPingV4Addr(AF_INET);
 
-static int ssmPingSocket = -1;
-
 static void handle_ssmping(int s, const Message &msg)
 {
 	if (msg.buffer[0] != SSMPING_REQUEST || msg.len > maxSSMPingMessage)
@@ -48,30 +46,30 @@ static void handle_ssmping(int s, const Message &msg)
 	SendTo(s, msg.buffer, msg.len, msg.to, mcastDest);
 }
 
-int SetupSSMPing() {
-	address addr(beaconUnicastAddr.family());
+int SetupSSMPing(int family) {
+	address addr(family);
 
 	if (!addr.set_port(4321))
 		return -1;
 
-	ssmPingSocket = SetupSocket(addr, true, false);
-	if (ssmPingSocket < 0)
+	int sock = SetupSocket(addr, true, false, 0);
+	if (sock < 0)
 		return -1;
 
-	if (!SetHops(ssmPingSocket, addr, 64)) {
-		close(ssmPingSocket);
+	if (!SetHops(sock, addr, 64)) {
+		close(sock);
 		return -1;
 	}
 
-	if (!RequireToAddress(ssmPingSocket, addr)) {
-		close(ssmPingSocket);
+	if (!RequireToAddress(sock, addr)) {
+		close(sock);
 		return -1;
 	}
 
 	assert(SSMPingV4Addr.set_addr(SSMPingV4ResponseChannel));
 	assert(SSMPingV6Addr.set_addr(SSMPingV6ResponseChannel));
 
-	ListenTo(ssmPingSocket, handle_ssmping);
+	ListenTo(sock, handle_ssmping);
 
 	return 0;
 }
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#include "dbeacon.h"
+#include "address.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Warm restart. The snapshot keeps what takes minutes to learn again: the
+ * sources with their names, the sessions they are in, which also gives the
+ * SSM channels to join, the last stats of each and our own sequence
+ * numbers, so the others don't see a new sequence. The pair matrices are
+ * not kept, every source's next report fills its row again. Stats keep
+ * their age, the time we were down included, and expire as they would
+ * have had we kept running.
+ *
+ * One record per line, strings last on theirs:
+ *
+ *   dbeacon-state 2 TIMEOFDAY
+ *   group SEQ SSMSEQ IFNAME|- NAME
+ *   source ADDR STTL FLAGS
+ *   name|contact|country STRING
+ *   view GROUP			the n-th group line, for the last source
+ *   asm|ssm AGE RTTL DELAY JITTER LOSS DUP OOO PVALID P.. P..
+ *
+ * TIMEOFDAY and AGE, since the last update of the stats, are in ms.
+ */
+
+#define STATE_VERSION	2
+
+static void save_stats(FILE *fp, const char *tag, const Stats &s, uint64_t now) {
+	fprintf(fp, "%s %llu %u %g %g %g %g %g %u", tag,
+		(unsigned long long)(now - s.lastupdate), (uint32_t)s.rttl, s.avgdelay,
+		s.avgjitter, s.avgloss, s.avgdup, s.avgooo, s.pvalid ? 1 : 0);
+
+	for (int k = 0; k < PCOUNT; k++)
+		fprintf(fp, " %g", s.pdelay[k]);
+	for (int k = 0; k < PCOUNT; k++)
+		fprintf(fp, " %g", s.pjitter[k]);
+
+	fprintf(fp, "\n");
+}
+
+/* names come from the network, one spanning lines would break the record */
+static void save_string(FILE *fp, const char *tag, const string &str) {
+	if (str.find_first_of("\r\n") == string::npos)
+		fprintf(fp, "%s %s\n", tag, str.c_str());
+}
+
+bool SaveState(const char *path) {
+	string tmpf = string(path) + ".working";
+
+	FILE *fp = fopen(tmpf.c_str(), "w");
+	if (fp == NULL) {
+		d_log(LOG_WARNING, "Failed to save state to %s: %s", tmpf.c_str(), strerror(errno));
+		return false;
+	}
+
+	uint64_t now = get_timestamp();
+
+	fprintf(fp, "dbeacon-state %u %llu\n", STATE_VERSION,
+		(unsigned long long)get_time_of_day());
+
+	/* views refer to sessions by their position here */
+	int position[MAX_SESSIONS];
+
+	for (uint32_t k = 0; k < sessions.size(); k++) {
+		const beaconSession &s = *sessions[k];
+
+		fprintf(fp, "group %u %u %s %s\n", s.seq, s.ssmSeq,
+			s.ifname.empty() ? "-" : s.ifname.c_str(), s.name.c_str());
+		position[s.index] = k;
+	}
+
+	for (Sources::const_iterator i = sources.begin(); i != sources.end(); ++i) {
+		const beaconSource &src = i->second;
+		char tmp[64];
+
+		fprintf(fp, "source %s %i %u\n", i->first.to_string(tmp, sizeof(tmp)),
+			src.sttl, src.Flags);
+
+		if (src.identified)
+			save_string(fp, "name", src.name);
+		if (!src.adminContact.empty())
+			save_string(fp, "contact", src.adminContact);
+		if (!src.CC.empty())
+			save_string(fp, "country", src.CC);
+
+		for (uint32_t k = 0; k < MAX_SESSIONS; k++) {
+			const sessionSource *view = src.views[k];
+			if (view == 0)
+				continue;
+
+			fprintf(fp, "view %i\n", position[k]);
+
+			if (view->ASM.s.is_valid(now))
+				save_stats(fp, "asm", view->ASM.s, now);
+			if (view->SSM.s.is_valid(now))
+				save_stats(fp, "ssm", view->SSM.s, now);
+		}
+	}
+
+	bool ok = !ferror(fp);
+
+	if (fclose(fp) != 0 || !ok || rename(tmpf.c_str(), path) != 0) {
+		d_log(LOG_WARNING, "Failed to save state to %s: %s", path, strerror(errno));
+		unlink(tmpf.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+static bool load_stats(const char *line, Stats &s, unsigned long long &age) {
+	unsigned rttl, pvalid;
+	int n;
+
+	if (sscanf(line, "%llu %u %f %f %f %f %f %u%n", &age, &rttl, &s.avgdelay,
+			&s.avgjitter, &s.avgloss, &s.avgdup, &s.avgooo, &pvalid, &n) != 8)
+		return false;
+
+	line += n;
+
+	for (int k = 0; k < PCOUNT; k++) {
+		if (sscanf(line, "%f%n", &s.pdelay[k], &n) != 1)
+			return false;
+		line += n;
+	}
+
+	for (int k = 0; k < PCOUNT; k++) {
+		if (sscanf(line, "%f%n", &s.pjitter[k], &n) != 1)
+			return false;
+		line += n;
+	}
+
+	s.rttl = rttl;
+	s.pvalid = pvalid != 0;
+	s.valid = true;
+
+	return true;
+}
+
+void LoadState(const char *path, uint64_t maxAge) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			d_log(LOG_WARNING, "Failed to read state from %s: %s", path, strerror(errno));
+		return;
+	}
+
+	char line[512];
+	unsigned version;
+	unsigned long long saved;
+
+	if (fgets(line, sizeof(line), fp) == NULL
+		|| sscanf(line, "dbeacon-state %u %llu", &version, &saved) != 2
+		|| version != STATE_VERSION) {
+		d_log(LOG_WARNING, "Ignoring state in %s, unknown format.", path);
+		fclose(fp);
+		return;
+	}
+
+	uint64_t now = get_timestamp();
+
+	/* stats age while we are down as well */
+	uint64_t tod = get_time_of_day();
+	uint64_t downtime = tod > saved ? tod - saved : 0;
+
+	/* the session of each group line, NULL if it is no longer run */
+	vector<beaconSession *> groups;
+
+	beaconSource *src = 0;
+	sessionSource *view = 0;
+	uint32_t restoredSources = 0, restoredStats = 0, expiredStats = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = 0;
+
+		char *arg = strchr(line, ' ');
+		if (arg == NULL)
+			continue;
+		*arg++ = 0;
+
+		if (!strcmp(line, "group")) {
+			char ifname[64];
+			unsigned seq, ssmSeq;
+			int n;
+
+			if (sscanf(arg, "%u %u %63s %n", &seq, &ssmSeq, ifname, &n) != 3)
+				break;
+
+			const char *name = arg + n;
+
+			if (!strcmp(ifname, "-"))
+				ifname[0] = 0;
+
+			beaconSession *session = 0;
+			for (Sessions::const_iterator i = sessions.begin(); i != sessions.end(); ++i) {
+				if ((*i)->name == name && (*i)->ifname == ifname)
+					session = *i;
+			}
+
+			if (session) {
+				session->seq = seq;
+				session->ssmSeq = ssmSeq;
+			}
+
+			groups.push_back(session);
+		} else if (!strcmp(line, "source")) {
+			char addr[64];
+			int sttl;
+			unsigned srcFlags;
+
+			src = 0;
+			view = 0;
+
+			address baddr;
+			if (sscanf(arg, "%63s %i %u", addr, &sttl, &srcFlags) != 3
+				|| !baddr.parse(addr, false))
+				continue;
+
+			/* once it is in a session */
+			src = getSource(baddr, 0, now, 0, false);
+			if (src == 0)
+				continue;
+
+			src->sttl = sttl;
+			src->Flags = srcFlags;
+			restoredSources++;
+		} else if (src && !strcmp(line, "name")) {
+			src->setName(arg, strlen(arg));
+		} else if (src && !strcmp(line, "contact")) {
+			src->adminContact = arg;
+		} else if (src && !strcmp(line, "country")) {
+			src->CC = arg;
+		} else if (src && !strcmp(line, "view")) {
+			uint32_t k = atoi(arg);
+
+			view = 0;
+			if (k < groups.size() && groups[k])
+				view = getSessionSource(*groups[k], src->addr, 0, now, 0, false);
+		} else if (view && (!strcmp(line, "asm") || !strcmp(line, "ssm"))) {
+			Stats s;
+			unsigned long long age;
+
+			if (!load_stats(arg, s, age))
+				continue;
+
+			/* would have timed out had we kept running */
+			if (age + downtime > maxAge) {
+				expiredStats++;
+				continue;
+			}
+
+			age += downtime;
+			s.lastupdate = now > age ? now - age : 0;
+
+			(line[0] == 'a' ? view->ASM : view->SSM).restore(s, now);
+			restoredStats++;
+		}
+	}
+
+	fclose(fp);
+
+	/* sources of groups no longer run */
+	vector<address> orphans;
+	for (Sources::const_iterator i = sources.begin(); i != sources.end(); ++i) {
+		uint32_t k = 0;
+		while (k < MAX_SESSIONS && i->second.views[k] == 0)
+			k++;
+		if (k == MAX_SESSIONS)
+			orphans.push_back(i->first);
+	}
+
+	for (vector<address>::const_iterator i = orphans.begin(); i != orphans.end(); ++i)
+		removeSource(*i, false);
+
+	info("Restored %u sources and %u stats from %s, %u stats expired",
+		restoredSources - (uint32_t)orphans.size(), restoredStats, path, expiredStats);
+}
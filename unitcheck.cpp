@@ -0,0 +1,706 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+/*
+ * Built by `make check'. Cases for the parts of dbeacon that behave the
+ * same on every run, checked without a network. dbeacon.cpp is included
+ * rather than linked so that its file local helpers can be reached.
+ */
+
+#define main dbeacon_main
+#include "dbeacon.cpp"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/un.h>
+
+static int checks = 0, failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		checks++; \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%i: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static bool seqwindow_test(const uint32_t *w, uint32_t age) {
+	return (w[age / 32] & (1 << (age % 32))) != 0;
+}
+
+static uint32_t seqwindow_count(const uint32_t *w) {
+	uint32_t n = 0;
+	for (uint32_t age = 0; age < SEQ_WINDOW; age++)
+		n += seqwindow_test(w, age);
+	return n;
+}
+
+static void check_seqwindow() {
+	uint32_t w[SEQ_WINDOW / 32];
+
+	/* shifts within a word and across word boundaries */
+	memset(w, 0, sizeof(w));
+	seqwindow_test_and_set(w, 0);
+	seqwindow_test_and_set(w, 5);
+	seqwindow_shift(w, 31);
+	CHECK(seqwindow_test(w, 31) && seqwindow_test(w, 36));
+	CHECK(seqwindow_count(w) == 2);
+	seqwindow_shift(w, 1);
+	CHECK(seqwindow_test(w, 32) && seqwindow_test(w, 37));
+	seqwindow_shift(w, 33);
+	CHECK(seqwindow_test(w, 65) && seqwindow_test(w, 70));
+	CHECK(seqwindow_count(w) == 2);
+
+	/* the oldest entry is kept, the next shift drops it */
+	memset(w, 0, sizeof(w));
+	seqwindow_test_and_set(w, 0);
+	seqwindow_shift(w, SEQ_WINDOW - 1);
+	CHECK(seqwindow_test(w, SEQ_WINDOW - 1) && seqwindow_count(w) == 1);
+	seqwindow_shift(w, 1);
+	CHECK(seqwindow_count(w) == 0);
+
+	/* shifts of the whole window or more clear it */
+	for (uint32_t n = SEQ_WINDOW; n <= SEQ_WINDOW + 33; n += 33) {
+		memset(w, 0xff, sizeof(w));
+		seqwindow_shift(w, n);
+		CHECK(seqwindow_count(w) == 0);
+	}
+
+	/* duplicates */
+	memset(w, 0, sizeof(w));
+	CHECK(!seqwindow_test_and_set(w, 40));
+	CHECK(seqwindow_test_and_set(w, 40));
+	CHECK(!seqwindow_test_and_set(w, 41));
+
+	/* probes 1, 2, 4, then 3 late, 3 again and one too old to count */
+	beaconMcastState st;
+	const uint64_t now = 1000000;
+	const int seqs[] = { 1, 2, 4, 3, 3, 4 - SEQ_WINDOW };
+
+	for (uint32_t k = 0; k < sizeof(seqs) / sizeof(seqs[0]); k++)
+		st.update(64, 1000 + seqs[k], now, now, now);
+
+	const statsWindow &sw = st.windows.windows[0];
+
+	CHECK(st.lastseq == 1004);
+	CHECK(sw.expected == 4);
+	CHECK(sw.received == 4);
+	CHECK(sw.lost == 0);
+	CHECK(sw.ooo == 1);
+	CHECK(sw.dup == 1);
+}
+
+static bool near(float value, float exact) {
+	return fabs(value - exact) <= exact / (1 << HIST_SUBBITS);
+}
+
+static void check_histogram() {
+	Histogram h;
+	float p[PCOUNT];
+
+	/* values below 2^HIST_SUBBITS have buckets of their own */
+	for (uint32_t v = 0; v < 8; v++)
+		h.add(v);
+	h.percentiles(p);
+	CHECK(p[0] == 3 && p[1] == 7 && p[2] == 7 && p[PMAX] == 7);
+
+	/* 1 to 1000, and above, within a bucket's resolution */
+	h.clear();
+	for (uint32_t v = 1; v <= 1000; v++)
+		h.add(v);
+	h.percentiles(p);
+	CHECK(near(p[0], 500) && near(p[1], 900) && near(p[2], 990));
+	CHECK(p[PMAX] == 1000);
+
+	/* a tail of 2% is past P90 but reaches P99 */
+	h.clear();
+	for (uint32_t k = 0; k < 980; k++)
+		h.add(20);
+	for (uint32_t k = 0; k < 20; k++)
+		h.add(400);
+	h.percentiles(p);
+	CHECK(near(p[0], 20) && near(p[1], 20) && near(p[2], 400));
+
+	/* values past 2^HIST_MAXBITS count in the last bucket, whose middle
+	 * is just below it */
+	h.clear();
+	h.add(0xffffffff);
+	h.percentiles(p);
+	CHECK(p[0] > (1 << (HIST_MAXBITS - 1)) && p[0] < (1 << HIST_MAXBITS));
+	CHECK(p[PMAX] == 0xffffffff);
+
+	/* counts are halved every HIST_DECAY values */
+	h.clear();
+	for (uint32_t k = 0; k < HIST_DECAY; k++)
+		h.add(10);
+	h.add(10);
+	CHECK(h.count == HIST_DECAY / 2 + 1);
+}
+
+/* One probe a second into windows of 10, 60 and 300 seconds */
+static void check_sliding_windows() {
+	slidingStats w;
+	const statsWindow *win = w.windows;
+
+	w.clear(0);
+	for (uint32_t t = 0; t < 400; t++) {
+		w.advance(t * 1000 + 500);
+		w.add(1, 1, 0, 0, 0, 5);
+
+		if (t == 9)
+			CHECK(win[0].expected == 10 && win[1].expected == 10);
+	}
+
+	CHECK(win[0].expected == 10 && win[1].expected == 60 && win[2].expected == 300);
+	CHECK(win[2].received == 300 && win[2].delay == 1500);
+
+	/* a gap, then its late probe */
+	w.advance(400000);
+	w.add(2, 1, 1, 0, 0, 5);
+	w.add(0, 1, -1, 0, 1, 10);
+	CHECK(win[0].expected == 11 && win[0].received == 11);
+	CHECK(win[0].lost == 0 && win[0].ooo == 1);
+
+	Stats s;
+	win[0].fill(s);
+	CHECK(s.avgloss == 0 && s.avgooo == 1 / 11.f && s.avgdelay == 60 / 11.f);
+
+	/* the clock going back changes nothing */
+	w.advance(1000);
+	CHECK(win[0].expected == 11);
+
+	/* ten quiet seconds empty the first window only */
+	w.advance(410000);
+	CHECK(win[0].expected == 0 && win[1].expected == 51 && win[2].expected == 291);
+
+	/* a longer silence than the history clears them all */
+	w.advance(410000 + STATS_HISTORY * 1000);
+	CHECK(win[1].expected == 0 && win[2].expected == 0 && win[2].delay == 0);
+}
+
+/* Pools stay listed in nodePool::pools, so they are never destroyed */
+static void check_pools() {
+	static nodePool small(3), odd(40);
+
+	CHECK(small.size == 2 * sizeof(void *));
+	CHECK(odd.size % (2 * sizeof(void *)) == 0 && odd.size >= 40);
+
+	/* nodes follow each other in the slab */
+	char *a = (char *)odd.alloc(), *b = (char *)odd.alloc();
+	CHECK(b == a + odd.size);
+	CHECK(odd.inuse == 2 && odd.reserved == POOL_SLAB_BYTES / odd.size);
+
+	/* released nodes are handed out again first */
+	odd.release(a);
+	CHECK(odd.alloc() == a && odd.inuse == 2);
+
+	/* a new slab once the first one is used up */
+	for (size_t k = odd.inuse; k <= POOL_SLAB_BYTES / odd.size; k++)
+		odd.alloc();
+	CHECK(odd.reserved == 2 * (POOL_SLAB_BYTES / odd.size));
+
+	size_t reserved, used;
+	pool_usage(reserved, used);
+	CHECK(reserved >= odd.reserved * odd.size && used >= odd.inuse * odd.size);
+
+	/* a table gives its nodes back as entries are removed */
+	typedef std::map<int, int, std::less<int>, poolAllocator<std::pair<const int, int> > > Table;
+	Table t;
+	for (int k = 0; k < 1000; k++)
+		t[k] = k;
+	pool_usage(reserved, used);
+	size_t full = used;
+	t.clear();
+	pool_usage(reserved, used);
+	CHECK(used < full && full - used >= 1000 * sizeof(std::pair<const int, int>));
+}
+
+/* Source 3 reporting on source 20 */
+static void check_pair_matrix() {
+	const uint64_t now = 1000000;
+	const int ASM = pairMatrix::ASM_CHANNEL, SSM = pairMatrix::SSM_CHANNEL;
+
+	beaconSource reporter;
+	reporter.id = 3;
+
+	sessionSource owner;
+	owner.source = &reporter;
+
+	beaconExternalStats ext;
+	ext.owner = &owner;
+	ext.ASM.valid = true;
+	ext.ASM.lastupdate = now;
+	ext.ASM.avgdelay = 12;
+
+	pairMatrix m;
+	m.update(3, &ext, 20, now);
+
+	CHECK(m.stride > 20 && m.stride % PAIR_BLOCK == 0);
+	CHECK(m.cell(3, 20) == &ext && m.cell(20, 3) == 0 && m.cell(3, m.stride) == 0);
+	CHECK(m.delay[ASM][3 * m.stride + 20] == 12);
+	CHECK(m.present[ASM][3 * m.stride + 20] && !m.present[SSM][3 * m.stride + 20]);
+
+	/* only fresh cells are alive */
+	CHECK(m.sweep(now + 1000, 5000) == 1);
+	CHECK(m.is_alive(ext, ASM) && !m.is_alive(ext, SSM));
+	CHECK(m.sweep(now + 10000, 5000) == 0 && !m.is_alive(ext, ASM));
+
+	/* cells keep their place when the matrix grows */
+	m.reserve(100);
+	CHECK(m.stride > 100 && m.cell(3, 20) == &ext);
+	CHECK(m.delay[ASM][3 * m.stride + 20] == 12);
+
+	/* an entry about another source moves to its column */
+	m.update(3, &ext, 21, now);
+	CHECK(m.cell(3, 20) == 0 && m.cell(3, 21) == &ext);
+
+	/* a source going away takes its row and column */
+	m.clear_source(21);
+	CHECK(m.cell(3, 21) == 0 && m.sweep(now, 5000) == 0);
+}
+
+/* Enough sources for the index to grow a few times, then every third one
+ * removed, which moves back the entries probing past them */
+static void check_source_index() {
+	const uint32_t count = 1000;
+	vector<beaconSource> srcs(count);
+	uint32_t parsed = 0;
+
+	for (uint32_t k = 0; k < count; k++) {
+		char tmp[64];
+		if (k % 2)
+			snprintf(tmp, sizeof(tmp), "10.2.%u.1/%u", k / 8, 1000 + k % 8);
+		else
+			snprintf(tmp, sizeof(tmp), "fd00::%x/%u", k / 8, 1000 + k % 8);
+		parsed += srcs[k].addr.parse(tmp, false, true);
+		index_source(&srcs[k]);
+	}
+	CHECK(parsed == count);
+
+	uint32_t found = 0;
+	for (uint32_t k = 0; k < count; k++)
+		found += find_source(srcs[k].addr) == &srcs[k];
+	CHECK(found == count);
+
+	address other;
+	other.parse("10.2.0.1/999", false, true);
+	CHECK(find_source(other) == 0);
+
+	for (uint32_t k = 0; k < count; k += 3)
+		unindex_source(&srcs[k]);
+
+	found = 0;
+	uint32_t gone = 0;
+	for (uint32_t k = 0; k < count; k++) {
+		if (k % 3)
+			found += find_source(srcs[k].addr) == &srcs[k];
+		else
+			gone += find_source(srcs[k].addr) == 0;
+	}
+	CHECK(found == count - (count + 2) / 3 && gone == (count + 2) / 3);
+
+	/* removing twice changes nothing */
+	unindex_source(&srcs[0]);
+	CHECK(find_source(srcs[1].addr) == &srcs[1]);
+
+	for (uint32_t k = 0; k < count; k += 3)
+		index_source(&srcs[k]);
+
+	found = 0;
+	for (uint32_t k = 0; k < count; k++) {
+		found += find_source(srcs[k].addr) == &srcs[k];
+		unindex_source(&srcs[k]);
+	}
+	CHECK(found == count && find_source(srcs[0].addr) == 0);
+}
+
+/* Stats restored after a restart keep their jitter until two probes
+ * can be compared */
+static void check_resync() {
+	beaconMcastState st;
+	Stats saved;
+	const uint64_t now = 1000000;
+
+	saved.avgjitter = 5;
+	saved.lastupdate = now - 2000;
+
+	st.restore(saved, now);
+	CHECK(st.s.lastupdate == now - 2000);
+
+	st.update(64, 7000, now - 100, now, now);
+	CHECK(st.s.avgjitter == 5);
+	CHECK(st.lastseq == 7000);
+	CHECK(st.windows.windows[0].lost == 0);
+
+	st.update(64, 7001, now + 1000 - 108, now + 1000, now + 1000);
+	CHECK(st.s.avgjitter == 15/16.f * 5 + 8/16.f);
+}
+
+static int bound_socket(const char *addr) {
+	address a;
+	a.parse(addr, false, true);
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock >= 0 && bind(sock, a.saddr(), a.addrlen()) != 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/* The filter of group sockets drops what any of our local endpoints
+ * sends, and nothing else */
+static void check_beacon_filter() {
+	int sock = bound_socket("127.0.0.1/47000");
+	int senders[3] = { bound_socket("127.0.0.1/47001"),
+		bound_socket("127.0.0.1/47002"), bound_socket("127.0.0.1/47003") };
+
+	if (sock < 0 || senders[0] < 0 || senders[1] < 0 || senders[2] < 0) {
+		printf("No loopback sockets, skipping the beacon filter\n");
+		return;
+	}
+
+	vector<address> self(2);
+	self[0].parse("127.0.0.1/47001", false, true);
+	self[1].parse("127.0.0.1/47002", false, true);
+
+	if (!AttachBeaconFilter(sock, self)) {
+		printf("No socket filters, skipping the beacon filter\n");
+		return;
+	}
+
+	address to;
+	to.parse("127.0.0.1/47000", false, true);
+
+	uint8_t probe[12] = { 0xbe, 0xac, PROTO_VER, 0 };
+	for (int k = 0; k < 3; k++) {
+		probe[11] = k;
+		sendto(senders[k], probe, sizeof(probe), 0, to.saddr(), to.addrlen());
+	}
+
+	uint8_t buf[64];
+	int received = 0, last = -1;
+	while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) == sizeof(probe)) {
+		received++;
+		last = buf[11];
+	}
+
+	CHECK(received == 1 && last == 2);
+
+	close(sock);
+	for (int k = 0; k < 3; k++)
+		close(senders[k]);
+}
+
+/* sends `lines' as a control client, returns what came back */
+static string control(int client, const char *lines) {
+	send(client, lines, strlen(lines), 0);
+	ControlRead(0);
+
+	string res;
+	char buf[512];
+	int len;
+	while ((len = recv(client, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		res.append(buf, len);
+
+	return res;
+}
+
+static bool starts_with(const string &str, const char *start) {
+	return str.compare(0, strlen(start), start) == 0;
+}
+
+static bool ends_with(const string &str, const char *end) {
+	return str.size() >= strlen(end) && str.compare(str.size() - strlen(end), string::npos, end) == 0;
+}
+
+static int control_client(const char *path) {
+	sockaddr_un sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock >= 0 && connect(sock, (sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/* Commands sent through the control socket, with a session and a source
+ * whose name needs escaping */
+static void check_control() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/unitcheck-control.%i", (int)getpid());
+
+	int client = ControlSetup(path) < 0 ? -1 : control_client(path);
+	if (client < 0) {
+		printf("No control socket, skipping the control commands\n");
+		unlink(path);
+		return;
+	}
+
+	CHECK(control(client, "\n  \t\n") == "");
+	CHECK(control(client, "bogus\n") == "ERR unknown command, try `help'\n");
+	CHECK(ends_with(control(client, "help\n"), "quit\nOK\n"));
+
+	/* partial lines wait for the rest, several lines get their replies
+	 * in order */
+	CHECK(control(client, "sou") == "");
+	CHECK(control(client, "rce\nsource 10.3.0.1/70000\nsource 10.3.0.1 x\n")
+		== "ERR usage: source ADDR[/PORT]\n"
+		"ERR usage: source ADDR[/PORT]\n"
+		"ERR usage: source ADDR[/PORT]\n");
+	CHECK(control(client, "source 10.3.0.1\n") == "ERR unknown source\n");
+	CHECK(control(client, "pair 10.3.0.1\n") == "ERR usage: pair FROM[/PORT] TO[/PORT]\n");
+
+	CHECK(control(client, "interval probe 0\n") == "ERR bad interval\n");
+	CHECK(control(client, "interval probe 2s\n") == "ERR bad interval\n");
+	CHECK(control(client, "interval other 2\n") == "ERR unknown interval\n");
+	CHECK(control(client, "interval probe 2\n") == "OK\n");
+	CHECK(starts_with(control(client, "interval\n"), "probe 2.00\n"));
+	/* following the traffic again, from the interval set */
+	CHECK(control(client, "interval probe auto\n") == "OK\n");
+	CHECK(starts_with(control(client, "interval\n"), "probe 2.00 auto\n"));
+
+	CHECK(control(client, "bootstrap put 10.3.0.9\n") == "ERR usage: bootstrap add|del ADDR[/PORT]\n");
+	CHECK(control(client, "group add 239.3.0.1 loud\n") == "ERR unknown argument loud\n");
+	CHECK(control(client, "group add 239.3.0.1 ssm=nowhere\n") == "ERR bad SSM channel\n");
+
+	beaconSession *session = new beaconSession(0);
+	session->name = "239.3.0.1/10000";
+	sessions.push_back(session);
+
+	address addr;
+	addr.parse("10.3.0.1/5000", false, true);
+	uint64_t now = get_timestamp();
+	beaconSource &src = *getSessionSource(*session, addr, 0, now, 0, false)->source;
+	src.identified = true;
+	src.name = "one \"two\"\x01";
+
+	CHECK(control(client, "groups\n") == "group 239.3.0.1/10000 sources 1\nOK\n");
+
+	/* typed without the port, the source is looked for through the table */
+	string res = control(client, "source 10.3.0.1\n");
+	CHECK(starts_with(res, "source 10.3.0.1/5000 name \"one \\\"two\\\"\\x01\" age 0\n"));
+	CHECK(res.find("  group 239.3.0.1/10000 lastupdate 0 reports 0\n") != string::npos);
+	CHECK(ends_with(res, "OK\n"));
+
+	removeSource(addr, false);
+	sessions.clear();
+	delete session;
+
+	/* quit closes the connection */
+	CHECK(control(client, "quit\nhelp\n") == "");
+	char c;
+	CHECK(recv(client, &c, 1, MSG_DONTWAIT) == 0);
+	close(client);
+
+	/* so does a line longer than the client's buffer */
+	client = control_client(path);
+	string longLine(1024, 'x');
+	CHECK(control(client, longLine.c_str()) == "");
+	CHECK(recv(client, &c, 1, MSG_DONTWAIT) == 0);
+	close(client);
+
+	unlink(path);
+}
+
+static beaconSession *test_session(uint32_t index, const char *name, const char *ifname) {
+	beaconSession *s = new beaconSession(index);
+	s->name = name;
+	s->ifname = ifname;
+	sessions.push_back(s);
+	return s;
+}
+
+/* Sources and stats saved, dropped and loaded back. Of the three groups
+ * saved, the third one is no longer run when loading. */
+static void check_state() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/unitcheck-state.%i", (int)getpid());
+
+	beaconSession *a = test_session(0, "239.4.0.1/10000", "");
+	beaconSession *b = test_session(1, "239.4.0.2/10000", "lo");
+	beaconSession *c = test_session(2, "239.4.0.3/10000", "");
+
+	a->seq = 100;
+	a->ssmSeq = 200;
+	b->seq = 300;
+
+	address addrs[3];
+	addrs[0].parse("10.4.0.1/5000", false, true);
+	addrs[1].parse("fd04::2/5001", false, true);
+	addrs[2].parse("10.4.0.3/5002", false, true);
+
+	uint64_t now = get_timestamp();
+
+	sessionSource *one = getSessionSource(*a, addrs[0], 0, now, 0, false);
+	one->source->setName("one", 3);
+	one->source->adminContact = "admin@example.net";
+	one->source->CC = "PT";
+	one->source->sttl = 64;
+	one->source->Flags = SSM_CAPABLE;
+
+	Stats &s = one->ASM.s;
+	s.valid = s.pvalid = true;
+	s.lastupdate = now - 1000;
+	s.rttl = 60;
+	s.avgdelay = 12.5;
+	s.avgjitter = 1.5;
+	s.avgloss = 0.25;
+	for (int k = 0; k < PCOUNT; k++) {
+		s.pdelay[k] = 10 * (k + 1);
+		s.pjitter[k] = k + 0.5;
+	}
+
+	/* in two groups, stats in the first still valid when saved but past
+	 * the age given to LoadState() */
+	sessionSource *two = getSessionSource(*a, addrs[1], 0, now, 0, false);
+	two->SSM.s.valid = true;
+	two->SSM.s.lastupdate = now - 8000;
+	getSessionSource(*b, addrs[1], 0, now, 0, false);
+
+	getSessionSource(*c, addrs[2], 0, now, 0, false);
+
+	CHECK(SaveState(path));
+
+	for (int k = 0; k < 3; k++)
+		removeSource(addrs[k], false);
+	a->seq = a->ssmSeq = b->seq = 0;
+
+	/* the third group is gone, and the second on another interface */
+	sessions.pop_back();
+	delete c;
+	b->ifname = "lo2";
+
+	LoadState(path, 5000);
+
+	CHECK(a->seq == 100 && a->ssmSeq == 200 && b->seq == 0);
+	CHECK(sources.size() == 2 && find_source(addrs[2]) == 0);
+
+	const beaconSource *src = find_source(addrs[0]);
+	CHECK(src && src->identified && src->name == "one");
+	CHECK(src && src->adminContact == "admin@example.net" && src->CC == "PT");
+	CHECK(src && src->sttl == 64 && src->Flags == SSM_CAPABLE);
+	CHECK(src && src->views[0] && !src->views[1]);
+
+	if (src && src->views[0]) {
+		const beaconMcastState &st = src->views[0]->ASM;
+
+		CHECK(st.resync && st.s.valid && !src->views[0]->SSM.s.valid);
+		CHECK(st.s.rttl == 60 && st.s.avgdelay == 12.5 && st.s.avgjitter == 1.5);
+		CHECK(st.s.avgloss == 0.25 && st.s.pvalid);
+		CHECK(st.s.pdelay[PMAX] == 10 * PCOUNT && st.s.pjitter[PMAX] == PMAX + 0.5);
+		/* the age is kept, saving and loading take a few ms */
+		CHECK(now - st.s.lastupdate >= 1000 && now - st.s.lastupdate < 1500);
+	}
+
+	/* stats older than the limit are not restored */
+	src = find_source(addrs[1]);
+	CHECK(src && src->views[0] && !src->views[1]);
+	CHECK(src && src->views[0] && !src->views[0]->SSM.s.valid);
+
+	for (int k = 0; k < 3; k++)
+		removeSource(addrs[k], false);
+
+	/* snapshots of another version are ignored */
+	FILE *fp = fopen(path, "w");
+	if (fp) {
+		fprintf(fp, "dbeacon-state 1 0\nsource 10.4.0.1/5000 64 0\nview 0\n");
+		fclose(fp);
+	}
+
+	LoadState(path, 5000);
+	CHECK(sources.empty());
+
+	while (!sessions.empty()) {
+		delete sessions.back();
+		sessions.pop_back();
+	}
+
+	unlink(path);
+}
+
+static void ignore_message(int, const Message &) {
+}
+
+/* Thousands of SSM sources joined on the loopback, with more descriptors
+ * allowed than select() can watch. The socket pool must stop short of
+ * FD_SETSIZE, the sources it has no room for stay pending. */
+static void check_ssm_pool() {
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 2 * FD_SETSIZE) {
+		rl.rlim_cur = rl.rlim_max < 2 * FD_SETSIZE ? rl.rlim_max : 2 * FD_SETSIZE;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	int lo = if_nametoindex("lo");
+
+	address group;
+	group.parse("232.0.3.3/10000", true);
+
+	int sock = lo ? SetupSocket(group, true, true, lo) : -1;
+	if (sock < 0) {
+		printf("No loopback SSM socket, skipping the socket pool\n");
+		return;
+	}
+
+	ListenTo(sock, ignore_message);
+	SSMJoinSetup(sock, group, lo, ignore_message);
+
+	const uint32_t count = 20000;
+
+	for (uint32_t k = 0; k < count; k++) {
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "10.%u.%u.1/10000", k / 250, k % 250 + 1);
+
+		address src;
+		src.parse(tmp, false);
+		CountSSMJoin(group, lo, src);
+	}
+
+	ssmJoinRate = 0;
+	for (int k = 0; k < 4; k++)
+		ApplySSMJoins();
+
+	int highest = 0;
+	for (McastSocks::const_iterator i = mcastSocks.begin(); i != mcastSocks.end(); ++i)
+		highest = max(highest, i->first);
+
+	ssmJoinStats st;
+	GetSSMJoinStats(st);
+
+	printf("%u of %u SSM sources joined through %u sockets\n", (uint32_t)st.joins,
+	       count, (uint32_t)mcastSocks.size());
+
+	CHECK(highest < FD_SETSIZE);
+	CHECK(st.joins >= 1000);
+	CHECK(st.joins + st.pending == count);
+}
+
+int main() {
+	update_clock();
+
+	check_seqwindow();
+	check_histogram();
+	check_sliding_windows();
+	check_pools();
+	check_pair_matrix();
+	check_source_index();
+	check_control();
+	check_state();
+	check_resync();
+	check_beacon_filter();
+	check_ssm_pool();
+
+	printf("%i of %i checks failed\n", failures, checks);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,475 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#include "dbeacon.h"
+#include "msocket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+
+#ifdef __linux__
+#include <linux/version.h>
+
+/* multishot recvmsg() appeared in 6.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES	256
+
+/* Receive buffers handed to the kernel, each holding the recvmsg header,
+ * the source address, the ancillary data and the payload */
+#define URING_BUFFERS	64
+#define URING_GROUP	0
+#define URING_NAMELEN	((int)sizeof(sockaddr_in6))
+#define URING_CTLLEN	64
+
+/* sends in flight, further sends go out synchronously */
+#define URING_SENDS	32
+
+/* the operation of a completion is in the low bits of its user_data */
+enum {
+	OP_RECV,
+	OP_SEND,
+	OP_TIMEOUT,
+	OP_BITS = 2,
+	OP_MASK = 3
+};
+
+static int ring = -1;
+static uint8_t *rings;
+static size_t ringsLen, sqesLen;
+
+static unsigned *sqHead, *sqTail, *sqMask, *sqEntries, *sqArray;
+static io_uring_sqe *sqes;
+static unsigned sqLocalTail = 0;
+
+static unsigned *cqHead, *cqTail, *cqMask;
+static io_uring_cqe *cqes;
+
+/* the ring tail overlays the reserved field of the first buffer, the
+ * header's flexible array doesn't start at 0 when compiled as C++ */
+static io_uring_buf_ring *bufRing;
+static io_uring_buf *bufs;
+static uint16_t bufTail = 0;
+static uint8_t *bufPool;
+static int bufLen;
+
+/* kernel side template of every multishot receive */
+static msghdr recvHdr;
+
+struct sendSlot {
+	msghdr hdr;
+	iovec iov;
+	address to;
+	uint8_t *data;
+	int next;
+};
+
+static sendSlot sendSlots[URING_SENDS];
+static int freeSend = -1;
+
+/* set when the kernel rejects a multishot receive after all */
+static bool recvFailed = false;
+
+static bool timeoutArmed = false;
+static uint64_t armedDeadline = 0;
+static __kernel_timespec timeoutSpec;
+
+static int uring_enter(unsigned submit, unsigned wait, unsigned flags) {
+	return syscall(__NR_io_uring_enter, ring, submit, wait, flags, NULL, 0);
+}
+
+static unsigned submit_pending() {
+	unsigned pending = sqLocalTail - *sqTail;
+
+	__atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+	return pending;
+}
+
+static io_uring_sqe *get_sqe() {
+	if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == *sqEntries)
+		uring_enter(submit_pending(), 0, 0);
+
+	unsigned idx = sqLocalTail & *sqMask;
+	io_uring_sqe *sqe = &sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[idx] = idx;
+	sqLocalTail++;
+
+	return sqe;
+}
+
+static void provide_buffer(uint16_t bid) {
+	io_uring_buf &b = bufs[bufTail & (URING_BUFFERS - 1)];
+
+	b.addr = (uint64_t)(uintptr_t)(bufPool + bid * bufLen);
+	b.len = bufLen;
+	b.bid = bid;
+
+	bufTail++;
+	__atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+static void *map_ring(size_t len, off_t off) {
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, off);
+
+	return p == MAP_FAILED ? 0 : p;
+}
+
+/* Kernels before 6.0 accept IORING_OP_RECVMSG and the buffer ring but
+ * reject the multishot flag once the request is issued. Post one on a
+ * socket of our own, cancel it right away and see which of the two it
+ * completes with. */
+static bool probe_multishot() {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return false;
+
+	UringListen(sock);
+
+	io_uring_sqe *sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ((uint64_t)sock << OP_BITS) | OP_RECV;
+	sqe->user_data = OP_TIMEOUT;
+
+	int res = -EINVAL;
+
+	if (uring_enter(submit_pending(), 2, IORING_ENTER_GETEVENTS) >= 0) {
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			const io_uring_cqe &cqe = cqes[head & *cqMask];
+
+			if ((cqe.user_data & OP_MASK) == OP_RECV)
+				res = cqe.res;
+		}
+
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	close(sock);
+
+	return res == -ECANCELED;
+}
+
+/* Undoes whatever UringSetup() got through before failing, keeping its
+ * errno. Nothing may be posted on the ring by then. */
+static bool setup_failed() {
+	int err = errno;
+
+	UringClose();
+
+	if (rings)
+		munmap(rings, ringsLen);
+	if (sqes)
+		munmap(sqes, sqesLen);
+	if (bufRing && bufRing != MAP_FAILED)
+		munmap(bufRing, URING_BUFFERS * sizeof(io_uring_buf));
+	delete [] bufPool;
+
+	rings = 0;
+	sqes = 0;
+	bufRing = 0;
+	bufPool = 0;
+
+	errno = err;
+	return false;
+}
+
+bool UringSetup(int payload) {
+	io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+
+	ring = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		ring = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	}
+
+	if (ring < 0)
+		return false;
+
+	size_t sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqlen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		return setup_failed();
+	}
+
+	ringsLen = sqlen > cqlen ? sqlen : cqlen;
+	sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+
+	rings = (uint8_t *)map_ring(ringsLen, IORING_OFF_SQ_RING);
+	sqes = (io_uring_sqe *)map_ring(sqesLen, IORING_OFF_SQES);
+
+	if (!rings || !sqes)
+		return setup_failed();
+
+	sqHead = (unsigned *)(rings + p.sq_off.head);
+	sqTail = (unsigned *)(rings + p.sq_off.tail);
+	sqMask = (unsigned *)(rings + p.sq_off.ring_mask);
+	sqEntries = (unsigned *)(rings + p.sq_off.ring_entries);
+	sqArray = (unsigned *)(rings + p.sq_off.array);
+	sqLocalTail = *sqTail;
+
+	cqHead = (unsigned *)(rings + p.cq_off.head);
+	cqTail = (unsigned *)(rings + p.cq_off.tail);
+	cqMask = (unsigned *)(rings + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(rings + p.cq_off.cqes);
+
+	bufRing = (io_uring_buf_ring *)mmap(NULL, URING_BUFFERS * sizeof(io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufRing == MAP_FAILED)
+		return setup_failed();
+
+	bufs = (io_uring_buf *)bufRing;
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_GROUP;
+
+	if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return setup_failed();
+
+	bufLen = sizeof(io_uring_recvmsg_out) + URING_NAMELEN + URING_CTLLEN + payload;
+	bufPool = new uint8_t[URING_BUFFERS * bufLen];
+
+	for (int i = 0; i < URING_BUFFERS; i++)
+		provide_buffer(i);
+
+	memset(&recvHdr, 0, sizeof(recvHdr));
+	recvHdr.msg_namelen = URING_NAMELEN;
+	recvHdr.msg_controllen = URING_CTLLEN;
+
+	if (!probe_multishot()) {
+		errno = EOPNOTSUPP;
+		return setup_failed();
+	}
+
+	for (int i = 0; i < URING_SENDS; i++) {
+		sendSlots[i].data = new uint8_t[payload];
+		sendSlots[i].next = freeSend;
+		freeSend = i;
+	}
+
+	return true;
+}
+
+void UringClose() {
+	/* closing the ring cancels the requests still posted */
+	if (ring >= 0)
+		close(ring);
+	ring = -1;
+}
+
+void UringListen(int sock) {
+	io_uring_sqe *sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t)(uintptr_t)&recvHdr;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_GROUP;
+	sqe->user_data = ((uint64_t)sock << OP_BITS) | OP_RECV;
+}
+
+int UringSendTo(int sock, const uint8_t *buffer, int len, const address &to) {
+	if (freeSend < 0)
+		return sendto(sock, buffer, len, 0, to.saddr(), to.addrlen());
+
+	int k = freeSend;
+	sendSlot &s = sendSlots[k];
+	freeSend = s.next;
+
+	memcpy(s.data, buffer, len);
+	s.to = to;
+
+	s.iov.iov_base = s.data;
+	s.iov.iov_len = len;
+
+	memset(&s.hdr, 0, sizeof(s.hdr));
+	s.hdr.msg_name = s.to.saddr();
+	s.hdr.msg_namelen = s.to.addrlen();
+	s.hdr.msg_iov = &s.iov;
+	s.hdr.msg_iovlen = 1;
+
+	io_uring_sqe *sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t)(uintptr_t)&s.hdr;
+	sqe->len = 1;
+	sqe->user_data = ((uint64_t)k << OP_BITS) | OP_SEND;
+
+	return len;
+}
+
+int UringWait(uint32_t wait) {
+	uint64_t deadline = get_timestamp() + wait;
+
+	/* an earlier timeout still pending wakes us up soon enough, a later
+	 * one just causes a spurious wakeup */
+	if (wait && (!timeoutArmed || deadline < armedDeadline)) {
+		timeoutSpec.tv_sec = wait / 1000;
+		timeoutSpec.tv_nsec = (wait % 1000) * 1000000;
+
+		io_uring_sqe *sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)&timeoutSpec;
+		sqe->len = 1;
+		sqe->user_data = (deadline << OP_BITS) | OP_TIMEOUT;
+
+		timeoutArmed = true;
+		armedDeadline = deadline;
+	}
+
+	unsigned submit = submit_pending();
+
+	if (!wait)
+		return uring_enter(submit, 0, 0);
+
+	return uring_enter(submit, 1, IORING_ENTER_GETEVENTS);
+}
+
+static void deliver(int sock, const uint8_t *buf, int len, void (*handler)(int, const Message &)) {
+	const io_uring_recvmsg_out *out = (const io_uring_recvmsg_out *)buf;
+	const uint8_t *name = buf + sizeof(*out);
+	const uint8_t *control = name + URING_NAMELEN;
+	uint8_t *payload = (uint8_t *)control + URING_CTLLEN;
+
+	if (len < (int)(payload - buf) || out->namelen > (unsigned)URING_NAMELEN)
+		return;
+
+	Message msg;
+
+	msg.from.set((const sockaddr *)name);
+
+	msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_control = (void *)control;
+	hdr.msg_controllen = out->controllen;
+
+	read_ancillary(hdr, msg.from, msg.to, msg.ttl, msg.timestamp);
+
+	msg.buffer = payload;
+	msg.len = out->payloadlen;
+
+	handler(sock, msg);
+}
+
+static void complete(const io_uring_cqe &cqe, void (*handler)(int, const Message &)) {
+	uint64_t data = cqe.user_data >> OP_BITS;
+
+	switch (cqe.user_data & OP_MASK) {
+	case OP_RECV:
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if (cqe.res > 0)
+				deliver((int)data, bufPool + bid * bufLen, cqe.res, handler);
+
+			provide_buffer(bid);
+		}
+
+		/* the kernel ended the receive, e.g. when it ran out of
+		 * buffers, post it again */
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			if (cqe.res == -EINVAL) {
+				recvFailed = true;
+				break;
+			} else if (cqe.res < 0 && cqe.res != -ENOBUFS)
+				d_log(LOG_DEBUG, "io_uring receive failed: %s", strerror(-cqe.res));
+
+			UringListen((int)data);
+		}
+		break;
+
+	case OP_SEND:
+		if (cqe.res < 0) {
+			char tmp[64];
+			d_log(LOG_DEBUG, "Failed to send to %s: %s",
+				sendSlots[data].to.to_string(tmp, sizeof(tmp)), strerror(-cqe.res));
+		}
+
+		sendSlots[data].next = freeSend;
+		freeSend = (int)data;
+		break;
+
+	case OP_TIMEOUT:
+		if (timeoutArmed && data == armedDeadline)
+			timeoutArmed = false;
+		break;
+	}
+}
+
+int UringDispatch(void (*handler)(int, const Message &)) {
+	unsigned head = *cqHead;
+	unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++)
+		complete(cqes[head & *cqMask], handler);
+
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+	if (recvFailed) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+bool UringSetup(int) {
+	errno = ENOSYS;
+	return false;
+}
+
+void UringListen(int) {
+}
+
+int UringSendTo(int sock, const uint8_t *buffer, int len, const address &to) {
+	return sendto(sock, buffer, len, 0, to.saddr(), to.addrlen());
+}
+
+int UringWait(uint32_t) {
+	errno = ENOSYS;
+	return -1;
+}
+
+int UringDispatch(void (*)(int, const Message &)) {
+	return 0;
+}
+
+void UringClose() {
+}
+
+#endif
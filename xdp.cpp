@@ -0,0 +1,375 @@
+/*
+ * Copyright 2005-2010, Hugo Santos <hugo@fivebits.net>
+ * Distributed under the terms of the MIT License.
+ */
+
+#include "dbeacon.h"
+#include "msocket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+
+#ifdef __linux__
+#include <linux/version.h>
+
+/* BPF links for XDP appeared in 5.9 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define HAVE_AF_XDP
+#endif
+#endif
+
+#ifdef HAVE_AF_XDP
+
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include <vector>
+
+#ifndef AF_XDP
+#define AF_XDP	44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP	283
+#endif
+
+/* 8MB of UMEM, all frames start in the fill ring */
+#define XDP_FRAME	2048
+#define XDP_FRAMES	4096
+#define XDP_RX_SIZE	2048
+#define XDP_CQ_SIZE	64
+
+struct xdpRing {
+	uint32_t *producer, *consumer;
+	void *desc;
+	uint32_t mask;
+};
+
+static int xsk = -1;
+static uint8_t *umem;
+static xdpRing rx, fill;
+static uint64_t xdpPackets = 0;
+
+static int sys_bpf(int cmd, bpf_attr &attr) {
+	return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+/* Minimal assembler for the steering program */
+struct xdpProgram {
+	enum {
+		PASS,
+		IPV4,
+		IPV6,
+		REDIRECT,
+		LABELS
+	};
+
+	std::vector<bpf_insn> insns;
+	std::vector<std::pair<int, int> > fixups;
+	int labels[LABELS];
+
+	void emit(uint8_t code, int dst, int src, int16_t off, int32_t imm) {
+		bpf_insn i;
+		memset(&i, 0, sizeof(i));
+		i.code = code;
+		i.dst_reg = dst;
+		i.src_reg = src;
+		i.off = off;
+		i.imm = imm;
+		insns.push_back(i);
+	}
+
+	/* jumps to `label' if `reg' compares with `imm' (or with register
+	 * `src' when BPF_X is set) */
+	void jump(uint8_t op, int reg, int src, int32_t imm, int label) {
+		fixups.push_back(std::make_pair((int)insns.size(), label));
+		emit(BPF_JMP | op, reg, src, 0, imm);
+	}
+
+	void mark(int label) {
+		labels[label] = insns.size();
+	}
+
+	void resolve() {
+		for (size_t k = 0; k < fixups.size(); k++) {
+			int at = fixups[k].first;
+			insns[at].off = labels[fixups[k].second] - (at + 1);
+		}
+	}
+};
+
+/* Redirects multicast UDP to `port' over IPv4 (without options, not
+ * fragmented) or IPv6 (without extension headers) into the socket of the
+ * receiving queue, if any. Everything else goes on to the stack, which
+ * also reassembles fragmented reports. */
+static void build_program(xdpProgram &p, int mapfd, uint16_t port) {
+	/* r6 = ctx, r2 = data, r3 = data_end */
+	p.emit(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0);
+	p.emit(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(xdp_md, data), 0);
+	p.emit(BPF_LDX | BPF_W | BPF_MEM, 3, 6, offsetof(xdp_md, data_end), 0);
+
+	/* Ethernet, IPv4 and UDP headers */
+	p.emit(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0);
+	p.emit(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14 + 20 + 8);
+	p.jump(BPF_JGT | BPF_X, 4, 3, 0, xdpProgram::PASS);
+
+	p.emit(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 12, 0);
+	p.jump(BPF_JEQ | BPF_K, 5, 0, htons(ETH_P_IP), xdpProgram::IPV4);
+	p.jump(BPF_JEQ | BPF_K, 5, 0, htons(ETH_P_IPV6), xdpProgram::IPV6);
+	p.jump(BPF_JA, 0, 0, 0, xdpProgram::PASS);
+
+	p.mark(xdpProgram::IPV4);
+	p.emit(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14, 0);
+	p.jump(BPF_JNE | BPF_K, 5, 0, 0x45, xdpProgram::PASS);
+	p.emit(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14 + 9, 0);
+	p.jump(BPF_JNE | BPF_K, 5, 0, IPPROTO_UDP, xdpProgram::PASS);
+	/* more fragments or fragment offset, loaded in network order */
+	p.emit(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 14 + 6, 0);
+	p.jump(BPF_JSET | BPF_K, 5, 0, htons(0x3fff), xdpProgram::PASS);
+	/* destination in 224.0.0.0/4 */
+	p.emit(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14 + 16, 0);
+	p.emit(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, 0xf0);
+	p.jump(BPF_JNE | BPF_K, 5, 0, 0xe0, xdpProgram::PASS);
+	p.emit(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 14 + 20 + 2, 0);
+	p.jump(BPF_JNE | BPF_K, 5, 0, htons(port), xdpProgram::PASS);
+	p.jump(BPF_JA, 0, 0, 0, xdpProgram::REDIRECT);
+
+	p.mark(xdpProgram::IPV6);
+	p.emit(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0);
+	p.emit(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14 + 40 + 8);
+	p.jump(BPF_JGT | BPF_X, 4, 3, 0, xdpProgram::PASS);
+	p.emit(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14 + 6, 0);
+	p.jump(BPF_JNE | BPF_K, 5, 0, IPPROTO_UDP, xdpProgram::PASS);
+	/* destination in ff00::/8 */
+	p.emit(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14 + 24, 0);
+	p.jump(BPF_JNE | BPF_K, 5, 0, 0xff, xdpProgram::PASS);
+	p.emit(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 14 + 40 + 2, 0);
+	p.jump(BPF_JNE | BPF_K, 5, 0, htons(port), xdpProgram::PASS);
+
+	/* bpf_redirect_map(map, rx_queue_index, XDP_PASS) */
+	p.mark(xdpProgram::REDIRECT);
+	p.emit(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(xdp_md, rx_queue_index), 0);
+	p.emit(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, mapfd);
+	p.emit(0, 0, 0, 0, 0);
+	p.emit(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS);
+	p.emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+	p.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	p.mark(xdpProgram::PASS);
+	p.emit(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS);
+	p.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	p.resolve();
+}
+
+static int load_program(int mapfd, uint16_t port) {
+	xdpProgram p;
+	build_program(p, mapfd, port);
+
+	static char log[4096];
+	static const char license[] = "Dual MIT/GPL";
+
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uint64_t)(uintptr_t)&p.insns[0];
+	attr.insn_cnt = p.insns.size();
+	attr.license = (uint64_t)(uintptr_t)license;
+	attr.log_buf = (uint64_t)(uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+
+	int fd = sys_bpf(BPF_PROG_LOAD, attr);
+	if (fd < 0 && verbose > 1)
+		info("XDP program rejected: %s", log);
+
+	return fd;
+}
+
+static void *map_ring(xdpRing &r, const xdp_ring_offset &off, uint32_t size,
+		size_t descsize, off_t pgoff) {
+	void *p = mmap(NULL, off.desc + size * descsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, xsk, pgoff);
+	if (p == MAP_FAILED)
+		return 0;
+
+	r.producer = (uint32_t *)((uint8_t *)p + off.producer);
+	r.consumer = (uint32_t *)((uint8_t *)p + off.consumer);
+	r.desc = (uint8_t *)p + off.desc;
+	r.mask = size - 1;
+
+	return p;
+}
+
+static void refill(uint64_t addr) {
+	uint32_t prod = *fill.producer;
+
+	((uint64_t *)fill.desc)[prod & fill.mask] = addr;
+	__atomic_store_n(fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+int XdpSetup(const char *ifname, int port) {
+	int ifindex = if_nametoindex(ifname);
+	if (ifindex == 0)
+		return -1;
+
+	xsk = socket(AF_XDP, SOCK_RAW, 0);
+	if (xsk < 0)
+		return -1;
+
+	umem = (uint8_t *)mmap(NULL, XDP_FRAME * XDP_FRAMES, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (umem == MAP_FAILED)
+		return -1;
+
+	xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uint64_t)(uintptr_t)umem;
+	reg.len = XDP_FRAME * XDP_FRAMES;
+	reg.chunk_size = XDP_FRAME;
+
+	if (setsockopt(xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0)
+		return -1;
+
+	int fillsize = XDP_FRAMES, cqsize = XDP_CQ_SIZE, rxsize = XDP_RX_SIZE;
+
+	if (setsockopt(xsk, SOL_XDP, XDP_UMEM_FILL_RING, &fillsize, sizeof(fillsize)) != 0
+		|| setsockopt(xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &cqsize, sizeof(cqsize)) != 0
+		|| setsockopt(xsk, SOL_XDP, XDP_RX_RING, &rxsize, sizeof(rxsize)) != 0)
+		return -1;
+
+	xdp_mmap_offsets off;
+	socklen_t offlen = sizeof(off);
+
+	if (getsockopt(xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &offlen) != 0)
+		return -1;
+
+	if (!map_ring(rx, off.rx, XDP_RX_SIZE, sizeof(xdp_desc), XDP_PGOFF_RX_RING)
+		|| !map_ring(fill, off.fr, XDP_FRAMES, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING))
+		return -1;
+
+	for (int i = 0; i < XDP_FRAMES; i++)
+		refill((uint64_t)i * XDP_FRAME);
+
+	/* zero copy where the driver supports it */
+	sockaddr_xdp sxdp;
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = 0;
+	sxdp.sxdp_flags = XDP_ZEROCOPY;
+
+	if (bind(xsk, (sockaddr *)&sxdp, sizeof(sxdp)) != 0) {
+		sxdp.sxdp_flags = XDP_COPY;
+		if (bind(xsk, (sockaddr *)&sxdp, sizeof(sxdp)) != 0)
+			return -1;
+	}
+
+	bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = 1;
+
+	int mapfd = sys_bpf(BPF_MAP_CREATE, attr);
+	if (mapfd < 0)
+		return -1;
+
+	uint32_t queue = 0, fd = xsk;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = mapfd;
+	attr.key = (uint64_t)(uintptr_t)&queue;
+	attr.value = (uint64_t)(uintptr_t)&fd;
+	attr.flags = BPF_ANY;
+
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, attr) != 0)
+		return -1;
+
+	int prog = load_program(mapfd, port);
+	if (prog < 0)
+		return -1;
+
+	/* the program stays attached as long as the link is open, i.e.
+	 * until we exit. Native mode where the driver has it. */
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+
+	if (sys_bpf(BPF_LINK_CREATE, attr) < 0) {
+		attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+		if (sys_bpf(BPF_LINK_CREATE, attr) < 0)
+			return -1;
+	}
+
+	if (verbose)
+		info("AF_XDP on %s/0, %s mode, %s", ifname,
+			attr.link_create.flags == XDP_FLAGS_SKB_MODE ? "generic" : "native",
+			sxdp.sxdp_flags == XDP_ZEROCOPY ? "zero copy" : "copying");
+
+	return xsk;
+}
+
+void XdpRead(void (*handler)(const Message &, bool ssm)) {
+	uint32_t cons = *rx.consumer;
+	uint32_t prod = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+
+	/* frames carry no timestamp, they were received in this pass */
+	uint64_t now = get_time_of_day();
+
+	for (; cons != prod; cons++) {
+		const xdp_desc &d = ((const xdp_desc *)rx.desc)[cons & rx.mask];
+
+		Message msg;
+		bool ssm;
+
+		if (d.len > ETH_HLEN && ParsePacket(umem + d.addr + ETH_HLEN, d.len - ETH_HLEN, msg, ssm)) {
+			msg.timestamp = now;
+			handler(msg, ssm);
+		}
+
+		refill(d.addr);
+		xdpPackets++;
+	}
+
+	__atomic_store_n(rx.consumer, cons, __ATOMIC_RELEASE);
+}
+
+void XdpStats(uint64_t &packets, uint64_t &drops) {
+	xdp_statistics st;
+	socklen_t len = sizeof(st);
+
+	packets = xdpPackets;
+	drops = 0;
+
+	if (xsk >= 0 && getsockopt(xsk, SOL_XDP, XDP_STATISTICS, &st, &len) == 0)
+		drops = st.rx_dropped + st.rx_ring_full + st.rx_fill_ring_empty_descs;
+}
+
+#else
+
+int XdpSetup(const char *, int) {
+	errno = ENOSYS;
+	return -1;
+}
+
+void XdpRead(void (*)(const Message &, bool)) {
+}
+
+void XdpStats(uint64_t &packets, uint64_t &drops) {
+	packets = drops = 0;
+}
+
+#endif